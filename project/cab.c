@@ -1,103 +1,635 @@
+// Based on: G. C. Buttazzo, "HARTIK: A real-time kernel for robotics applications"
+// Zero-copy, lock-free CAB: messages are never copied. put_mes() publishes a
+// buffer by storing its index in the history ring and get_mes() hands readers
+// a pointer to that same buffer, pinned by a per-buffer reference count until unget().
+// Only C11 atomics are used, so one writer and any number of readers may run
+// on different cores or from interrupt context without locks.
+// Free buffers are kept in a bitmap and every buffer starts with a small header
+// holding its index, so all operations are O(1) in the number of buffers.
+// Storage is either static (CAB_DEFINE + init_cab) or allocated once by open_cab.
+// The cab keeps a reference on the last depth published messages, so readers
+// can also pin a short history of messages (get_mes_history).
+// Each buffer header also records the sequence number and time of its publish,
+// so readers can tell how old a message is and skip stale ones (get_mes_fresh).
+// Readers waiting for a newer message (get_mes_newer) sleep until the sequence
+// number changes, on a futex on Linux and with interrupts locked around one
+// semaphore on Zephyr; put_mes wakes them all only when somebody waits and
+// leaves nothing pending, so it is ISR safe and never piles up wakeups.
+// Built with -DCAB_STATS it also counts publishes, reads, failed reservations,
+// the peak of busy buffers and how long readers hold each buffer (cab_stats).
+// On Linux a cab named "/something" lives in POSIX shared memory and is shared
+// by processes: everything is stored there and each process keeps its own
+// handle with pointers into its mapping.
+// This file is shared by the host tools and the Zephyr apps (src/cab.c is a copy).
+#ifdef __ZEPHYR__
+#include <zephyr.h>
+#else
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
 #include "cab.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
 #define IMGWIDTH 128
 
-uint8_t** castImage(uint8_t* img);
+// header in front of every buffer, the message starts CAB_ALIGN bytes after it
+struct cab_hdr
+{
+    uint32_t index;
+    uint32_t seq;     // publish sequence number, set by put_mes
+    cab_time_t stamp; // publish time, set by put_mes
+};
+_Static_assert(sizeof(struct cab_hdr) <= CAB_ALIGN, "buffer header over CAB_ALIGN");
+
+static inline struct cab_hdr *buffer_hdr(cab *cab_id, unsigned int i)
+{
+    return (struct cab_hdr *)(cab_id->storage + (size_t)i * cab_id->stride);
+}
+
+static inline void *buffer_mes(cab *cab_id, unsigned int i)
+{
+    return (uint8_t *)buffer_hdr(cab_id, i) + CAB_ALIGN;
+}
+
+// index of a buffer handed out by this cab, -1 if it is not one of ours
+static int buffer_index(cab *cab_id, void *buf_pointer)
+{
+    if (buf_pointer == NULL)
+        return -1;
+    struct cab_hdr *hdr = (struct cab_hdr *)((uint8_t *)buf_pointer - CAB_ALIGN);
+    if (hdr->index >= (unsigned int)cab_id->num || buffer_hdr(cab_id, hdr->index) != hdr)
+        return -1;
+    return (int)hdr->index;
+}
+
+// takes a reference unless the buffer is already free (it may be reserved next)
+static int ref_not_zero(atomic_uint *use)
+{
+    unsigned int u = atomic_load(use);
+    while (u != 0)
+        if (atomic_compare_exchange_weak(use, &u, u + 1))
+            return 1;
+    return 0;
+}
+
+cab_time_t cab_now(void)
+{
+#ifdef __ZEPHYR__
+    return k_cycle_get_32();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (cab_time_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+#ifdef CAB_STATS
+#define STAT_INC(c, field) atomic_fetch_add(&(c)->ctl->counters.field, 1)
+#define STAT_DEC(c, field) atomic_fetch_sub(&(c)->ctl->counters.field, 1)
+
+#define ATOMIC_MAX(obj, v)                                             \
+    do                                                                 \
+    {                                                                  \
+        __typeof__(v) _cur = atomic_load(obj);                         \
+        while (_cur < (v) && !atomic_compare_exchange_weak(obj, &_cur, (v))) \
+            ;                                                          \
+    } while (0)
+#define ATOMIC_MIN(obj, v)                                             \
+    do                                                                 \
+    {                                                                  \
+        __typeof__(v) _cur = atomic_load(obj);                         \
+        while (_cur > (v) && !atomic_compare_exchange_weak(obj, &_cur, (v))) \
+            ;                                                          \
+    } while (0)
+
+static void stat_busy(cab *cab_id)
+{
+    unsigned int busy = atomic_fetch_add(&cab_id->ctl->counters.busy, 1) + 1;
+    ATOMIC_MAX(&cab_id->ctl->counters.peak_busy, busy);
+}
+
+// a reader got buffer i, the first one starts the hold time
+static void hold_begin(cab *cab_id, unsigned int i)
+{
+    STAT_INC(cab_id, reads);
+    if (atomic_fetch_add(&cab_id->hold[i].readers, 1) == 0)
+        atomic_store(&cab_id->hold[i].since, cab_now());
+}
+
+// a reader released buffer i, the last one ends the hold time
+static void hold_end(cab *cab_id, unsigned int i)
+{
+    struct cab_hold *h = &cab_id->hold[i];
+    // read before leaving: once readers is 0 a new first reader may restart it
+    cab_time_t since = atomic_load(&h->since);
+    if (atomic_fetch_sub(&h->readers, 1) != 1)
+        return;
+    cab_time_t held = cab_now() - since;
+    ATOMIC_MIN(&h->min, held);
+    ATOMIC_MAX(&h->max, held);
+    if (atomic_fetch_add(&h->sum_lo, held) + held < held)
+        atomic_fetch_add(&h->sum_hi, 1);
+    atomic_fetch_add(&h->count, 1);
+}
+#else
+#define STAT_INC(c, field)
+#define STAT_DEC(c, field)
+#define stat_busy(c)
+#define hold_begin(c, i)
+#define hold_end(c, i)
+#endif
+
+// history entries pack the publish sequence number with the buffer index
+#define HIST_ENTRY(seq, i) (((seq) << 8) | (i))
+#define HIST_INDEX(e) ((e) & 0xFF)
+#define HIST_SEQ_MATCH(e, seq) ((((e) ^ ((seq) << 8)) & ~0xFFu) == 0)
+#define HIST_EMPTY 0xFFFFFFFFu
+
+// drops a reference, the last one returns the buffer to the free bitmap
+static void ref_put(cab *cab_id, unsigned int i)
+{
+    if (atomic_fetch_sub(&cab_id->use[i], 1) == 1)
+    {
+        STAT_DEC(cab_id, busy);
+        atomic_fetch_or(&cab_id->free_mask[i / CAB_WORD_BITS], 1u << (i % CAB_WORD_BITS));
+    }
+}
+
+// creates a new cab
+// num must be at least the number of readers + 2 (one being filled, one most recent)
+cab *open_cab(char *name, int num, size_t dim, void *first)
+{
+    return open_cab_history(name, num, dim, 1, first);
+}
+
+static void init_state(cab *cab_id, void *first);
+
+#ifndef __ZEPHYR__
+#define CAB_SHM_MAGIC 0x43414231u // "CAB1"
+#define CAB_SHM_WAIT_MS 1000      // how long to wait for the creator
 
-struct cab
+// a shared memory cab starts with this header, followed by use, free_mask,
+// hist, hold and the buffers as laid out by shm_layout
+struct cab_shm
 {
-    char *name;
+    atomic_uint ready; // CAB_SHM_MAGIC once the creator initialized it
     int num;
     size_t dim;
-    void **buffers;
-    uint8_t *buffersTaken;
+    unsigned int depth;
+    struct cab_ctl ctl;
 };
 
-// creates a new cab
-cab *open_cab(char *name, int num, size_t dim, void *first)
+// points the handle into a mapping at base (if not NULL), returns its size
+static size_t shm_layout(cab *cab_id, uint8_t *base)
+{
+    size_t off = sizeof(struct cab_shm);
+    if (base != NULL)
+    {
+        cab_id->ctl = &((struct cab_shm *)base)->ctl;
+        cab_id->use = (atomic_uint *)(base + off);
+    }
+    off += cab_id->num * sizeof(atomic_uint);
+    if (base != NULL)
+        cab_id->free_mask = (atomic_uint *)(base + off);
+    off += CAB_MASK_WORDS(cab_id->num) * sizeof(atomic_uint);
+    if (base != NULL)
+        cab_id->hist = (atomic_uint *)(base + off);
+    off += cab_id->depth * sizeof(atomic_uint);
+#ifdef CAB_STATS
+    off = (off + _Alignof(struct cab_hold) - 1) / _Alignof(struct cab_hold) * _Alignof(struct cab_hold);
+    if (base != NULL)
+        cab_id->hold = (struct cab_hold *)(base + off);
+    off += cab_id->num * sizeof(struct cab_hold);
+#endif
+    off = (off + CAB_ALIGN - 1) / CAB_ALIGN * CAB_ALIGN;
+    if (base != NULL)
+        cab_id->storage = base + off;
+    return off + cab_id->num * cab_id->stride;
+}
+
+static void shm_sleep(void)
+{
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    nanosleep(&ts, NULL);
+}
+
+// creates the shared memory cab new_cab->name, or attaches to it if another
+// process already did. The mapping is page aligned, so buffers keep CAB_ALIGN.
+static cab *open_shm_cab(cab *new_cab, void *first)
+{
+    size_t size = shm_layout(new_cab, NULL);
+    int creator = 1;
+    int fd = shm_open(new_cab->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        creator = 0;
+        fd = shm_open(new_cab->name, O_RDWR, 0);
+    }
+    if (fd < 0)
+    {
+        free(new_cab);
+        return NULL;
+    }
+
+    struct stat st;
+    int ok = 1;
+    if (creator)
+        ok = ftruncate(fd, size) == 0;
+    else
+    {
+        // the creator may not have sized it yet
+        for (int t = 0; t < CAB_SHM_WAIT_MS && fstat(fd, &st) == 0 && st.st_size == 0; t++)
+            shm_sleep();
+        ok = fstat(fd, &st) == 0 && (size_t)st.st_size == size;
+    }
+    uint8_t *base = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        if (creator)
+            shm_unlink(new_cab->name);
+        free(new_cab);
+        return NULL;
+    }
+
+    struct cab_shm *shm = (struct cab_shm *)base;
+    shm_layout(new_cab, base);
+    if (creator)
+    {
+        shm->num = new_cab->num;
+        shm->dim = new_cab->dim;
+        shm->depth = new_cab->depth;
+        init_state(new_cab, first);
+        atomic_store(&shm->ready, CAB_SHM_MAGIC);
+        return new_cab;
+    }
+
+    for (int t = 0; t < CAB_SHM_WAIT_MS && atomic_load(&shm->ready) != CAB_SHM_MAGIC; t++)
+        shm_sleep();
+    if (atomic_load(&shm->ready) != CAB_SHM_MAGIC || shm->num != new_cab->num ||
+        shm->dim != new_cab->dim || shm->depth != new_cab->depth)
+    {
+        munmap(base, size);
+        free(new_cab);
+        return NULL;
+    }
+    return new_cab;
+}
+
+int unlink_cab(char *name)
 {
+    return shm_unlink(name);
+}
+#endif
+
+// creates a new cab keeping the last depth messages
+// num must be at least depth + readers * (messages each reader pins) + 1
+cab *open_cab_history(char *name, int num, size_t dim, unsigned int depth, void *first)
+{
+    if (num < 2 || num > CAB_MAX_BUFFERS || depth < 1 || depth >= (unsigned int)num)
+        return NULL;
     cab *new_cab = calloc(1, sizeof(cab));
     new_cab->name = name;
     new_cab->num = num;
     new_cab->dim = dim;
-    new_cab->buffersTaken = (uint8_t *)calloc(num, sizeof(uint8_t));
-    for (size_t i = 0; i < num; i++)
-        new_cab->buffersTaken[i] = 0;
-    printf("allocating buffers\n");
-
-    // allocate all buffers
-    new_cab->buffers = (void **)calloc(num, sizeof(void *));
-    for (size_t i = 0; i < num; i++)
-        new_cab->buffers[i] = calloc(1, dim);
-    printf("copying first\n");
-
-    memcpy(new_cab->buffers[0], first, dim);
-    new_cab->buffersTaken[0] = 1; // The first will always be taken
+    new_cab->stride = CAB_STRIDE(dim);
+    new_cab->depth = depth;
+#ifndef __ZEPHYR__
+    if (name != NULL && name[0] == '/')
+        return open_shm_cab(new_cab, first);
+#endif
+    new_cab->ctl = (struct cab_ctl *)calloc(1, sizeof(struct cab_ctl));
+    new_cab->use = (atomic_uint *)calloc(num, sizeof(atomic_uint));
+    new_cab->free_mask = (atomic_uint *)calloc(CAB_MASK_WORDS(num), sizeof(atomic_uint));
+    new_cab->hist = (atomic_uint *)calloc(depth, sizeof(atomic_uint));
+#ifdef CAB_STATS
+    new_cab->hold = (struct cab_hold *)calloc(num, sizeof(struct cab_hold));
+#endif
+    new_cab->storage = (uint8_t *)aligned_alloc(CAB_ALIGN, num * new_cab->stride);
+    init_cab(new_cab, first);
     return new_cab;
 }
 
+void close_cab(cab *cab_id)
+{
+#ifndef __ZEPHYR__
+    if (cab_id->name != NULL && cab_id->name[0] == '/')
+    {
+        // the storage pointers all point into one mapping starting at ctl
+        munmap((uint8_t *)cab_id->ctl - offsetof(struct cab_shm, ctl), shm_layout(cab_id, NULL));
+        free(cab_id);
+        return;
+    }
+#endif
+    free(cab_id->storage);
+    free(cab_id->use);
+    free(cab_id->free_mask);
+    free(cab_id->hist);
+#ifdef CAB_STATS
+    free(cab_id->hold);
+#endif
+    free(cab_id->ctl);
+    free(cab_id);
+}
+
+// initializes the buffers of a cab, allocated by open_cab or by CAB_DEFINE
+void init_cab(cab *cab_id, void *first)
+{
+    init_state(cab_id, first);
+}
+
+static void init_state(cab *cab_id, void *first)
+{
+    for (int w = 0; w < CAB_MASK_WORDS(cab_id->num); w++)
+        atomic_init(&cab_id->free_mask[w], 0);
+    for (int i = 0; i < cab_id->num; i++)
+    {
+        buffer_hdr(cab_id, i)->index = i;
+        atomic_init(&cab_id->use[i], 0);
+        if (i > 0)
+            atomic_fetch_or(&cab_id->free_mask[i / CAB_WORD_BITS], 1u << (i % CAB_WORD_BITS));
+    }
+    for (unsigned int h = 1; h < cab_id->depth; h++)
+        atomic_init(&cab_id->hist[h], HIST_EMPTY);
+
+    // the first message is the only copy the cab ever makes
+    memcpy(buffer_mes(cab_id, 0), first, cab_id->dim);
+    atomic_init(&cab_id->use[0], 1);
+    atomic_init(&cab_id->hist[0], HIST_ENTRY(0u, 0u));
+    atomic_init(&cab_id->ctl->seq, 0);
+    buffer_hdr(cab_id, 0)->seq = 0;
+    buffer_hdr(cab_id, 0)->stamp = cab_now();
+
+    atomic_init(&cab_id->ctl->waiters, 0);
+#ifdef __ZEPHYR__
+    k_sem_init(&cab_id->ctl->wake, 0, 1);
+#endif
+
+#ifdef CAB_STATS
+    memset(&cab_id->ctl->counters, 0, sizeof(cab_id->ctl->counters));
+    memset(cab_id->hold, 0, cab_id->num * sizeof(struct cab_hold));
+    for (int i = 0; i < cab_id->num; i++)
+        atomic_init(&cab_id->hold[i].min, (cab_time_t)-1);
+    stat_busy(cab_id); // the first message
+#endif
+}
+
 // returns a new buffer
 void *reserve(cab *cab_id)
 {
-    // find a free buffer
-    for (size_t i = 0; i < cab_id->num; i++)
+    // claim the lowest free buffer for the writer
+    for (int w = 0; w < CAB_MASK_WORDS(cab_id->num); w++)
     {
-        if (cab_id->buffersTaken[i] == 0)
+        unsigned int mask = atomic_load(&cab_id->free_mask[w]);
+        while (mask != 0)
         {
-            cab_id->buffersTaken[i] = 1;
-            return cab_id->buffers[i];
+            unsigned int bit = 1u << __builtin_ctz(mask);
+            mask = atomic_fetch_and(&cab_id->free_mask[w], ~bit);
+            if (mask & bit)
+            {
+                unsigned int i = w * CAB_WORD_BITS + __builtin_ctz(bit);
+                atomic_store(&cab_id->use[i], 1);
+                stat_busy(cab_id);
+                return buffer_mes(cab_id, i);
+            }
         }
     }
+    STAT_INC(cab_id, reserve_failures);
     return NULL;
 }
 
-// puts a filled buffer inside the CAB
+// puts a filled buffer inside the CAB, it becomes the most recent message
 void put_mes(void *buf_pointer, cab *cab_id)
 {
+    int i = buffer_index(cab_id, buf_pointer);
+    if (i < 0)
+        return;
+    // the writer's reference becomes the history reference, the slot is
+    // written before seq so readers never see a seq without its entry
+    unsigned int seq = atomic_load(&cab_id->ctl->seq) + 1;
+    buffer_hdr(cab_id, i)->seq = seq;
+    buffer_hdr(cab_id, i)->stamp = cab_now();
+    STAT_INC(cab_id, publishes);
+    unsigned int old = atomic_exchange(&cab_id->hist[seq % cab_id->depth], HIST_ENTRY(seq, (unsigned int)i));
+    atomic_store(&cab_id->ctl->seq, seq);
+    // the message that fell out of the history is freed once no reader holds it
+    if (old != HIST_EMPTY)
+        ref_put(cab_id, HIST_INDEX(old));
 
-    for (size_t i = 0; i < cab_id->num; i++)
+    // wakes every reader sleeping in get_mes_newer: they sleep only while seq
+    // is unchanged, so nothing is left pending for later ones
+    if (atomic_load(&cab_id->ctl->waiters) != 0)
+#ifdef __ZEPHYR__
+        k_sem_reset(&cab_id->ctl->wake);
+#else
+        syscall(SYS_futex, &cab_id->ctl->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+// pins the message published as number seq, fails if the writer has
+// overwritten its history entry meanwhile
+static int pin_published(cab *cab_id, unsigned int seq, unsigned int *index)
+{
+    atomic_uint *slot = &cab_id->hist[seq % cab_id->depth];
+    unsigned int e = atomic_load(slot);
+    if (e == HIST_EMPTY || !HIST_SEQ_MATCH(e, seq))
+        return 0;
+    if (!ref_not_zero(&cab_id->use[HIST_INDEX(e)]))
+        return 0; // fell out of the history and freed meanwhile
+    // the buffer may have been recycled between the two steps above
+    if (atomic_load(slot) != e)
     {
-        if (cab_id->buffers[i] == buf_pointer)
-        {
-            memcpy(cab_id->buffers[0], cab_id->buffers[i], cab_id->dim);
-            cab_id->buffersTaken[i] = 0;
-        }
+        ref_put(cab_id, HIST_INDEX(e));
+        return 0;
     }
+    *index = HIST_INDEX(e);
+    hold_begin(cab_id, *index);
+    return 1;
 }
 
-// get latest message
+// get latest message, the buffer is shared and must not be written to
 void *get_mes(cab *cab_id)
 {
+    unsigned int i;
+    while (!pin_published(cab_id, atomic_load(&cab_id->ctl->seq), &i))
+        ;
+    return buffer_mes(cab_id, i);
+}
+
+// milliseconds from an arbitrary start, for the timeout of get_mes_newer
+static int64_t cab_ms(void)
+{
+#ifdef __ZEPHYR__
+    return k_uptime_get();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
 
-    // find a free buffer
-    for (size_t i = 0; i < cab_id->num; i++)
+// sleeps while the cab has published seq messages, at most timeout_ms
+// (CAB_FOREVER: no limit). It may return early, callers check again.
+static void wait_newer(cab *cab_id, unsigned int seq, int32_t timeout_ms)
+{
+#ifdef __ZEPHYR__
+    // checked and pended with interrupts locked, so put_mes cannot publish
+    // in between; the lock is released while this thread sleeps
+    unsigned int key = irq_lock();
+    if (atomic_load(&cab_id->ctl->seq) == seq)
     {
-        if (cab_id->buffersTaken[i] == 0)
+        atomic_fetch_add(&cab_id->ctl->waiters, 1);
+        k_sem_take(&cab_id->ctl->wake, timeout_ms == CAB_FOREVER ? K_FOREVER : K_MSEC(timeout_ms));
+        atomic_fetch_sub(&cab_id->ctl->waiters, 1);
+    }
+    irq_unlock(key);
+#else
+    // registered before the kernel compares seq, so a put_mes after the
+    // comparison sees the waiter and wakes it
+    struct timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    atomic_fetch_add(&cab_id->ctl->waiters, 1);
+    syscall(SYS_futex, &cab_id->ctl->seq, FUTEX_WAIT, seq, timeout_ms == CAB_FOREVER ? NULL : &ts, NULL, 0);
+    atomic_fetch_sub(&cab_id->ctl->waiters, 1);
+#endif
+}
+
+// get a message newer than *seq, blocking until there is one
+void *get_mes_newer(cab *cab_id, unsigned int *seq, int32_t timeout_ms)
+{
+    int64_t deadline = cab_ms() + timeout_ms;
+    while (atomic_load(&cab_id->ctl->seq) == *seq)
+    {
+        int32_t left = CAB_FOREVER;
+        if (timeout_ms != CAB_FOREVER)
         {
-            cab_id->buffersTaken[i] = 1;
-            memcpy(cab_id->buffers[i], cab_id->buffers[0], cab_id->dim);
-            return cab_id->buffers[i];
+            int64_t l = deadline - cab_ms();
+            if (l <= 0 || timeout_ms == 0)
+                return NULL;
+            left = (int32_t)l;
         }
+        wait_newer(cab_id, *seq, left);
+    }
+
+    void *mes = get_mes(cab_id);
+    *seq = ((struct cab_hdr *)((uint8_t *)mes - CAB_ALIGN))->seq;
+    return mes;
+}
+
+// get latest message unless it is older than max_age
+void *get_mes_fresh(cab *cab_id, cab_time_t max_age)
+{
+    void *mes = get_mes(cab_id);
+    if (cab_now() - cab_mes_time(cab_id, mes, NULL) > max_age)
+    {
+        unget(mes, cab_id);
+        return NULL;
+    }
+    return mes;
+}
+
+cab_time_t cab_mes_time(cab *cab_id, void *mes_pointer, unsigned int *seq)
+{
+    int i = buffer_index(cab_id, mes_pointer);
+    if (i < 0)
+        return 0;
+    if (seq != NULL)
+        *seq = buffer_hdr(cab_id, i)->seq;
+    return buffer_hdr(cab_id, i)->stamp;
+}
+
+// pins the k most recent messages, newest first
+int get_mes_history(cab *cab_id, int k, void *out[])
+{
+    if (k > (int)cab_id->depth)
+        k = cab_id->depth;
+    for (;;)
+    {
+        unsigned int seq = atomic_load(&cab_id->ctl->seq), i;
+        int n = 0;
+        if ((unsigned int)k > seq + 1)
+            k = seq + 1; // not that many messages published yet
+        while (n < k && pin_published(cab_id, seq - n, &i))
+            out[n++] = buffer_mes(cab_id, i);
+        if (n == k)
+            return n;
+        // the writer overtook us, start over from the new most recent message
+        while (n > 0)
+            unget(out[--n], cab_id);
     }
-    return NULL;
 }
 
 // release message to the CAB
 void unget(void* mes_pointer, cab *cab_id)
 {
-    for (size_t i = 0; i < cab_id->num; i++)
+    int i = buffer_index(cab_id, mes_pointer);
+    if (i >= 0)
     {
-        if (cab_id->buffers[i] == mes_pointer)
-        {
-            cab_id->buffersTaken[i] = 0;
-        }
+        hold_end(cab_id, i);
+        ref_put(cab_id, i);
     }
 }
 
+// snapshot of the instrumentation counters
+int cab_stats(cab *cab_id, struct cab_stats *stats, struct cab_hold_stats *hold)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (hold != NULL)
+        memset(hold, 0, cab_id->num * sizeof(*hold));
+#ifdef CAB_STATS
+    stats->publishes = atomic_load(&cab_id->ctl->counters.publishes);
+    stats->reads = atomic_load(&cab_id->ctl->counters.reads);
+    stats->reserve_failures = atomic_load(&cab_id->ctl->counters.reserve_failures);
+    stats->busy = atomic_load(&cab_id->ctl->counters.busy);
+    stats->peak_busy = atomic_load(&cab_id->ctl->counters.peak_busy);
+    for (int i = 0; hold != NULL && i < cab_id->num; i++)
+    {
+        struct cab_hold *h = &cab_id->hold[i];
+        hold[i].count = atomic_load(&h->count);
+        if (hold[i].count == 0)
+            continue;
+        hold[i].min = atomic_load(&h->min);
+        hold[i].max = atomic_load(&h->max);
+        uint64_t sum = atomic_load(&h->sum_lo);
+        if (sizeof(cab_time_t) < sizeof(uint64_t))
+            sum += (uint64_t)atomic_load(&h->sum_hi) << 32;
+        hold[i].avg = (cab_time_t)(sum / hold[i].count);
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+#ifdef CAB_SELFTEST
+#include <sys/wait.h>
+#include <stdarg.h>
+
+CAB_DEFINE(static_cab, 3, 100);
+
+static int failures;
+
+// reports a failed check, main returns non zero if there was any
+static void fail(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    failures++;
+}
+
 int main(int argc, char const *argv[])
 {
 
@@ -243,15 +775,16 @@ int main(int argc, char const *argv[])
     // testing
     cab *cab1;
     cab1 = open_cab("images", 3, IMGWIDTH * IMGWIDTH, (void*)buffer);
-    printf("cab %s -> num=%ld, dim=%d\n", cab1->name, cab1->num, cab1->dim);
+    printf("cab %s -> num=%d, dim=%zu\n", cab1->name, cab1->num, cab1->dim);
 
-    uint8_t **buffer1 = castImage((uint8_t *)get_mes(cab1));
+    uint8_t *mes1 = (uint8_t *)get_mes(cab1);
+    uint8_t (*buffer1)[IMGWIDTH] = (uint8_t (*)[IMGWIDTH])mes1; // 2D view, no copy
     for (size_t i = 0; i < IMGWIDTH; i++)
     {
         for (size_t j = 0; j < IMGWIDTH; j++)
         {
             if(buffer1[i][j] != left_45_guide_image_data[i][j])
-            printf("%d differs from %d, ", buffer1[i][j], left_45_guide_image_data[i][j]);
+            fail("%d differs from %d, ", buffer1[i][j], left_45_guide_image_data[i][j]);
         }
     }
 
@@ -267,32 +800,143 @@ int main(int argc, char const *argv[])
     put_mes((void *)free_buffer, cab1);
 
     uint8_t *buffer2 = get_mes(cab1);
+    if (buffer2 != free_buffer)
+        fail("get_mes copied the message instead of sharing it\n");
 
     for (size_t i = 0; i < IMGWIDTH; i++)
     {
         for (size_t j = 0; j < IMGWIDTH; j++)
         {
              if(buffer2[i*IMGWIDTH+ j] !=255)
-            printf("%d differs from %d, ", buffer2[i*IMGWIDTH+ j],255);
+            fail("%d differs from %d, ", buffer2[i*IMGWIDTH+ j],255);
+             // the old message stays pinned while mes1 is held
+             if(mes1[i*IMGWIDTH+ j] != left_45_guide_image_data[i][j])
+            fail("%d differs from %d, ", mes1[i*IMGWIDTH+ j], left_45_guide_image_data[i][j]);
         }
     }
 
-    unget((void *)buffer1, cab1);
+    unget((void *)mes1, cab1);
     unget((void *)buffer2, cab1);
 
-    return 0;
-}
+    // both non recent buffers are free again
+    void *r1 = reserve(cab1);
+    void *r2 = reserve(cab1);
+    if (r1 == NULL || r2 == NULL || reserve(cab1) != NULL)
+        fail("buffers were not released\n");
 
-uint8_t** castImage(uint8_t* img)
-{
-    uint8_t** image = (uint8_t**)calloc(IMGWIDTH, sizeof(uint8_t*));
-    for(int i = 0; i < IMGWIDTH; i++){
-        image[i] = (uint8_t*)calloc(IMGWIDTH, sizeof(uint8_t));
-    } 
-    for(int i = 0; i < IMGWIDTH; i++){
-        for(int j = 0; j < IMGWIDTH; j++){
-            image[i][j] = img[i*IMGWIDTH + j];
-        }
+    // statically allocated cab, messages are cache line aligned
+    uint8_t small[100] = {1, 2, 3};
+    init_cab(&static_cab, small);
+    uint8_t *mes3 = (uint8_t *)get_mes(&static_cab);
+    if (((uintptr_t)mes3 % CAB_ALIGN) != 0 || memcmp(mes3, small, sizeof(small)) != 0)
+        fail("static cab not initialized\n");
+    unget(mes3, &static_cab);
+
+    // history of the last 3 messages, pinned without copies
+    uint8_t hfirst[16] = {0};
+    cab *hcab = open_cab_history("history", 5, sizeof(hfirst), 3, hfirst);
+    void *hist[3];
+    if (get_mes_history(hcab, 3, hist) != 1)
+        fail("history longer than what was published\n");
+    unget(hist[0], hcab);
+    for (uint8_t m = 1; m <= 4; m++)
+    {
+        uint8_t *h = (uint8_t *)reserve(hcab);
+        h[0] = m;
+        put_mes(h, hcab);
     }
-    return image;
-}
\ No newline at end of file
+    if (get_mes_history(hcab, 3, hist) != 3 || ((uint8_t *)hist[0])[0] != 4 ||
+        ((uint8_t *)hist[1])[0] != 3 || ((uint8_t *)hist[2])[0] != 2)
+        fail("history does not hold the last 3 messages\n");
+    // with 3 pinned in the history and 1 free the writer still gets a buffer
+    void *h5 = reserve(hcab);
+    if (h5 == NULL)
+        fail("no buffer left for the writer\n");
+    put_mes(h5, hcab);
+    for (int h = 0; h < 3; h++)
+        unget(hist[h], hcab);
+
+    // versioned reads: nothing newer than the last one seen, then one more
+    unsigned int seen = 0;
+    uint8_t *n1 = (uint8_t *)get_mes_newer(hcab, &seen, CAB_FOREVER);
+    if (n1 != h5 || seen != 5)
+        fail("get_mes_newer did not return the latest message\n");
+    unget(n1, hcab);
+    if (get_mes_newer(hcab, &seen, 0) != NULL || get_mes_newer(hcab, &seen, 10) != NULL)
+        fail("get_mes_newer returned an old message\n");
+    uint8_t *h6 = (uint8_t *)reserve(hcab);
+    put_mes(h6, hcab);
+    if ((n1 = get_mes_newer(hcab, &seen, 10)) != h6 || seen != 6)
+        fail("get_mes_newer missed a new message\n");
+    unget(n1, hcab);
+
+    // publish time: a message just published is fresh, later it is stale
+    cab_time_t t0 = cab_now();
+    uint8_t *h7 = (uint8_t *)reserve(hcab);
+    put_mes(h7, hcab);
+    unsigned int h7_seq;
+    if (cab_mes_time(hcab, h7, &h7_seq) < t0 || h7_seq != 7)
+        fail("message not stamped when published\n");
+    uint8_t *f1 = (uint8_t *)get_mes_fresh(hcab, CAB_MS(100));
+    if (f1 != h7)
+        fail("get_mes_fresh rejected a fresh message\n");
+    unget(f1, hcab);
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 20000000};
+    nanosleep(&wait, NULL);
+    if (get_mes_fresh(hcab, CAB_MS(10)) != NULL)
+        fail("get_mes_fresh returned a stale message\n");
+
+    // timed out waits leave nothing behind: no reader stays registered and a
+    // later wait sleeps its whole timeout instead of waking for old publishes
+    unget(get_mes_newer(hcab, &seen, 0), hcab);
+    for (int round = 0; round < 5; round++)
+    {
+        for (int w = 0; w < 10; w++)
+            if (get_mes_newer(hcab, &seen, 1) != NULL)
+                fail("get_mes_newer returned an old message\n");
+        put_mes(reserve(hcab), hcab);
+        unget(get_mes_newer(hcab, &seen, 0), hcab);
+    }
+    int64_t w0 = cab_ms();
+    if (get_mes_newer(hcab, &seen, 20) != NULL || cab_ms() - w0 < 20)
+        fail("get_mes_newer woke up with nothing new\n");
+    if (atomic_load(&hcab->ctl->waiters) != 0)
+        fail("%u readers still registered after their timeout\n", atomic_load(&hcab->ctl->waiters));
+
+    // shared memory cab: a child process reads what the parent publishes
+    unlink_cab("/cab_selftest");
+    cab *scab = open_cab("/cab_selftest", 3, sizeof(hfirst), hfirst);
+    if (scab == NULL)
+        fail("shared memory cab not created\n");
+    if (open_cab("/cab_selftest", 3, sizeof(hfirst) + 1, hfirst) != NULL)
+        fail("attached to a shared cab of another size\n");
+    pid_t child = fork();
+    if (child == 0)
+    {
+        cab *ccab = open_cab("/cab_selftest", 3, sizeof(hfirst), NULL);
+        unsigned int cseen = 0;
+        uint8_t *c = ccab ? (uint8_t *)get_mes_newer(ccab, &cseen, 2000) : NULL;
+        int ok = c != NULL && c[0] == 42 && cseen == 1;
+        if (c != NULL)
+            unget(c, ccab);
+        _exit(ok ? 0 : 1);
+    }
+    uint8_t *s1 = (uint8_t *)reserve(scab);
+    s1[0] = 42;
+    put_mes(s1, scab);
+    int status;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fail("child did not read the shared message\n");
+    // the child released it: all but the latest are free
+    if (reserve(scab) == NULL || reserve(scab) == NULL || reserve(scab) != NULL)
+        fail("shared buffers were not released\n");
+    close_cab(scab);
+    unlink_cab("/cab_selftest");
+
+    if (failures != 0)
+        printf("%d checks failed\n", failures);
+    return failures != 0;
+}
+
+#endif
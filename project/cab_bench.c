@@ -0,0 +1,182 @@
+/* ************************************************************
+ * CAB throughput and latency benchmark
+ * Sweeps message size, number of consumers and publish rate.
+ * The producer stamps every message with cab_now() right before
+ * put_mes() and consumers blocked in get_mes_newer() measure the
+ * publish to read latency.
+ * Two designs are compared on the same CAB:
+ *   zerocopy - readers use the shared buffer in place
+ *   copy     - the producer copies its frame into the buffer and
+ *              every reader copies it out, like the old CAB did
+ * Output is CSV on stdout.
+ *
+ * usage: cab_bench [milliseconds per point]
+ ************************************************************** */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "cab.h"
+
+#define MAX_CONSUMERS 16
+#define MAX_SAMPLES 100000 /* latency samples kept per consumer */
+
+const size_t sizes[] = {16, 256, 4096, 65536, 1048576};
+const int consumer_counts[] = {1, 2, 4, 8, 16};
+const int rates[] = {0, 10000, 1000}; /* publishes per second, 0 = as fast as possible */
+
+cab *bench_cab;
+size_t mes_size;
+uint8_t *first; /* zeroed first message, big enough for every size */
+int copy_design;
+atomic_int running;
+
+struct consumer
+{
+	pthread_t tid;
+	uint64_t reads;
+	int nsamples;
+	cab_time_t samples[MAX_SAMPLES];
+	uint8_t *copy; /* private frame for the copy design */
+} consumers[MAX_CONSUMERS];
+
+void *producer(void *arg)
+{
+	uint64_t publishes = 0;
+	int rate = *(int *)arg;
+	uint8_t *frame = calloc(1, mes_size);
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (atomic_load(&running))
+	{
+		if (rate > 0)
+		{
+			next.tv_nsec += 1000000000L / rate;
+			if (next.tv_nsec >= 1000000000L)
+			{
+				next.tv_nsec -= 1000000000L;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+		uint8_t *mes = (uint8_t *)reserve(bench_cab);
+		if (mes == NULL)
+			continue;
+		if (copy_design)
+			memcpy(mes, frame, mes_size);
+		cab_time_t now = cab_now();
+		memcpy(mes, &now, sizeof(now) < mes_size ? sizeof(now) : mes_size);
+		put_mes(mes, bench_cab);
+		publishes++;
+	}
+	free(frame);
+	return (void *)(uintptr_t)publishes;
+}
+
+void *consumer(void *arg)
+{
+	struct consumer *c = (struct consumer *)arg;
+	unsigned int seen = 0;
+
+	while (atomic_load(&running))
+	{
+		uint8_t *mes = (uint8_t *)get_mes_newer(bench_cab, &seen, 50);
+		if (mes == NULL)
+			continue;
+		cab_time_t stamp;
+		memcpy(&stamp, mes, sizeof(stamp));
+		if (copy_design)
+			memcpy(c->copy, mes, mes_size);
+		cab_time_t now = cab_now();
+		unget(mes, bench_cab);
+		if (c->nsamples < MAX_SAMPLES)
+			c->samples[c->nsamples++] = now - stamp;
+		c->reads++;
+	}
+	return NULL;
+}
+
+int cmp_time(const void *a, const void *b)
+{
+	cab_time_t x = *(const cab_time_t *)a, y = *(const cab_time_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Runs one point of the sweep and prints its CSV line */
+void run_point(int ncons, int rate, int duration_ms)
+{
+	/* a new cab for every point (so no state is carried over):
+	   1 latest + 1 being filled + 1 per consumer */
+	bench_cab = open_cab("bench", MAX_CONSUMERS + 2, mes_size, first);
+	atomic_store(&running, 1);
+
+	for (int i = 0; i < ncons; i++)
+	{
+		consumers[i].reads = 0;
+		consumers[i].nsamples = 0;
+		consumers[i].copy = copy_design ? malloc(mes_size) : NULL;
+		pthread_create(&consumers[i].tid, NULL, consumer, &consumers[i]);
+	}
+	pthread_t prod;
+	pthread_create(&prod, NULL, producer, &rate);
+
+	struct timespec d = {.tv_sec = duration_ms / 1000, .tv_nsec = (duration_ms % 1000) * 1000000L};
+	nanosleep(&d, NULL);
+	atomic_store(&running, 0);
+
+	void *ret;
+	pthread_join(prod, &ret);
+	uint64_t publishes = (uint64_t)(uintptr_t)ret, reads = 0;
+	int total = 0;
+	for (int i = 0; i < ncons; i++)
+	{
+		pthread_join(consumers[i].tid, NULL);
+		reads += consumers[i].reads;
+		total += consumers[i].nsamples;
+	}
+
+	/* merge the latency samples of all consumers */
+	cab_time_t *all = malloc((total + 1) * sizeof(cab_time_t));
+	int n = 0;
+	for (int i = 0; i < ncons; i++)
+	{
+		memcpy(&all[n], consumers[i].samples, consumers[i].nsamples * sizeof(cab_time_t));
+		n += consumers[i].nsamples;
+		free(consumers[i].copy);
+	}
+	qsort(all, n, sizeof(cab_time_t), cmp_time);
+	unsigned long long p50 = n ? all[n / 2] : 0;
+	unsigned long long p99 = n ? all[(n * 99ull) / 100] : 0;
+	unsigned long long p999 = n ? all[(n * 999ull) / 1000] : 0;
+
+	double secs = duration_ms / 1000.0;
+	printf("%s,%zu,%d,%d,%.0f,%.0f,%llu,%llu,%llu\n", copy_design ? "copy" : "zerocopy", mes_size, ncons, rate,
+		   publishes / secs, reads / secs, p50, p99, p999);
+	fflush(stdout);
+
+	free(all);
+	close_cab(bench_cab);
+}
+
+int main(int argc, char *argv[])
+{
+	int duration_ms = argc > 1 ? atoi(argv[1]) : 200;
+	first = calloc(1, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+	printf("design,msg_size,consumers,rate_hz,publishes_per_s,reads_per_s,p50_ns,p99_ns,p999_ns\n");
+	for (copy_design = 0; copy_design < 2; copy_design++)
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+			for (size_t c = 0; c < sizeof(consumer_counts) / sizeof(consumer_counts[0]); c++)
+				for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+				{
+					mes_size = sizes[s];
+					run_point(consumer_counts[c], rates[r], duration_ms);
+				}
+	return 0;
+}
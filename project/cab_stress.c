@@ -0,0 +1,161 @@
+/* ************************************************************
+ * CAB stress test
+ * One producer and N consumers, each pinned to its own core,
+ * hammer a CAB for a few seconds. Consumers check that every
+ * message they get is complete (not torn by the writer) and
+ * that messages never go back in time. Every other read pins
+ * the last two messages, which must be consecutive. Consumers
+ * with an even number block for new messages instead of polling.
+ *
+ * usage: cab_stress [consumers] [seconds] [message size]
+ ************************************************************** */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "cab.h"
+
+#define MAX_CONSUMERS 64
+
+cab *stress_cab;
+size_t mes_size = 4096;
+atomic_int running = 1;
+atomic_ulong errors = 0;
+
+/* Pins the calling thread to one core (wrapping around on small hosts) */
+void pin_to_core(int core)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* Every message is filled with its sequence number */
+void *producer(void *arg)
+{
+	uint64_t seq = 1;
+	pin_to_core(0);
+
+	while (atomic_load(&running))
+	{
+		uint64_t *mes = (uint64_t *)reserve(stress_cab);
+		if (mes == NULL)
+		{
+			printf("reserve() failed with num = depth + 2 * consumers + 1\n");
+			atomic_fetch_add(&errors, 1);
+			break;
+		}
+		for (size_t i = 0; i < mes_size / sizeof(uint64_t); i++)
+			mes[i] = seq;
+		put_mes(mes, stress_cab);
+		seq++;
+	}
+	return (void *)(uintptr_t)seq;
+}
+
+void *consumer(void *arg)
+{
+	uint64_t last = 0, reads = 0;
+	unsigned int seen = 0;
+	int blocking = ((intptr_t)arg % 2) == 0;
+	pin_to_core((int)(intptr_t)arg);
+
+	while (atomic_load(&running))
+	{
+		uint64_t *mes;
+		if (blocking)
+		{
+			mes = (uint64_t *)get_mes_newer(stress_cab, &seen, 100);
+			if (mes == NULL)
+				continue;
+			/* the producer numbers messages like the cab does */
+			if (mes[0] != seen)
+				atomic_fetch_add(&errors, 1);
+		}
+		else
+			mes = (uint64_t *)get_mes(stress_cab);
+		uint64_t seq = mes[0];
+		for (size_t i = 1; i < mes_size / sizeof(uint64_t); i++)
+		{
+			if (mes[i] != seq)
+			{
+				atomic_fetch_add(&errors, 1);
+				break;
+			}
+		}
+		if (seq < last)
+			atomic_fetch_add(&errors, 1);
+		last = seq;
+		reads++;
+		unget(mes, stress_cab);
+
+		void *hist[2];
+		if (get_mes_history(stress_cab, 2, hist) == 2)
+		{
+			if (((uint64_t *)hist[0])[0] != ((uint64_t *)hist[1])[0] + 1)
+				atomic_fetch_add(&errors, 1);
+			unget(hist[0], stress_cab);
+			unget(hist[1], stress_cab);
+			reads += 2;
+		}
+	}
+	return (void *)(uintptr_t)reads;
+}
+
+int main(int argc, char *argv[])
+{
+	int consumers = argc > 1 ? atoi(argv[1]) : 3;
+	int seconds = argc > 2 ? atoi(argv[2]) : 2;
+	if (argc > 3)
+		mes_size = (size_t)atol(argv[3]) & ~(sizeof(uint64_t) - 1);
+	if (consumers < 1 || consumers > MAX_CONSUMERS || mes_size < sizeof(uint64_t))
+	{
+		printf("usage: %s [consumers 1-%d] [seconds] [message size]\n", argv[0], MAX_CONSUMERS);
+		return 1;
+	}
+
+	uint64_t *first = calloc(1, mes_size);
+	/* history of 2 + 2 pinned per consumer + 1 being filled */
+	stress_cab = open_cab_history("stress", 2 * consumers + 3, mes_size, 2, first);
+
+	pthread_t prod, cons[MAX_CONSUMERS];
+	pthread_create(&prod, NULL, producer, NULL);
+	for (int i = 0; i < consumers; i++)
+		pthread_create(&cons[i], NULL, consumer, (void *)(intptr_t)(i + 1));
+
+	sleep(seconds);
+	atomic_store(&running, 0);
+
+	void *ret;
+	unsigned long reads = 0;
+	pthread_join(prod, &ret);
+	unsigned long writes = (unsigned long)(uintptr_t)ret - 1;
+	for (int i = 0; i < consumers; i++)
+	{
+		pthread_join(cons[i], &ret);
+		reads += (unsigned long)(uintptr_t)ret;
+	}
+
+	printf("%d consumers, %zu byte messages: %lu writes, %lu reads, %lu errors\n",
+		   consumers, mes_size, writes, reads, (unsigned long)atomic_load(&errors));
+
+	struct cab_stats stats;
+	struct cab_hold_stats hold[2 * MAX_CONSUMERS + 3];
+	if (cab_stats(stress_cab, &stats, hold) == 0)
+	{
+		printf("cab: %u publishes, %u reads, %u failed reservations, peak %u of %d buffers busy\n",
+			   stats.publishes, stats.reads, stats.reserve_failures, stats.peak_busy, 2 * consumers + 3);
+		for (int i = 0; i < 2 * consumers + 3; i++)
+			if (hold[i].count > 0)
+				printf("  buffer %2d: held %u times, min %llu avg %llu max %llu ns\n", i, hold[i].count,
+					   (unsigned long long)hold[i].min, (unsigned long long)hold[i].avg, (unsigned long long)hold[i].max);
+	}
+	return atomic_load(&errors) == 0 ? 0 : 1;
+}
@@ -1,16 +1,201 @@
+#ifndef CAB_H
+#define CAB_H
+
 #include<stdint.h>
 #include<stddef.h>
+#include<stdatomic.h>
+#ifdef __ZEPHYR__
+#include <zephyr.h>
+typedef uint32_t cab_time_t; // hardware cycles, k_cycle_get_32()
+#define CAB_MS(ms) ((cab_time_t)k_ms_to_cyc_ceil32(ms))
+#else
+typedef uint64_t cab_time_t; // nanoseconds, CLOCK_MONOTONIC
+#define CAB_MS(ms) ((cab_time_t)(ms) * 1000000u)
+#endif
+
+// timeout of get_mes_newer() that never expires
+#define CAB_FOREVER (-1)
+
+// alignment of every buffer and message, one cache line
+#ifndef CAB_ALIGN
+#ifdef __ZEPHYR__
+#define CAB_ALIGN 32
+#else
+#define CAB_ALIGN 64
+#endif
+#endif
+
+// buffer indexes are packed with a sequence number in 8 bits
+#define CAB_MAX_BUFFERS 255
+
+#define CAB_WORD_BITS 32
+#define CAB_MASK_WORDS(num) (((num) + CAB_WORD_BITS - 1) / CAB_WORD_BITS)
+// a buffer is a header of CAB_ALIGN bytes followed by the message
+#define CAB_STRIDE(dim) (CAB_ALIGN + (((dim) + CAB_ALIGN - 1) / CAB_ALIGN) * CAB_ALIGN)
 
 typedef struct cab cab;
 
+// Instrumentation, compiled in with -DCAB_STATS and read with cab_stats()
+struct cab_stats
+{
+    uint32_t publishes;
+    uint32_t reads;
+    uint32_t reserve_failures; // reserve() returned NULL
+    uint32_t busy;             // buffers not free right now
+    uint32_t peak_busy;        // high-water mark of busy, compare it with num
+};
+
+// time a buffer was held by readers, from the first get to the last unget
+struct cab_hold_stats
+{
+    uint32_t count;
+    cab_time_t min, max, avg;
+};
+
+#ifdef CAB_STATS
+struct cab_counters
+{
+    atomic_uint publishes, reads, reserve_failures, busy, peak_busy;
+};
+
+struct cab_hold
+{
+    atomic_uint readers;
+    _Atomic cab_time_t since;
+    atomic_uint count;
+    _Atomic cab_time_t min, max, sum_lo;
+    atomic_uint sum_hi; // carries of sum_lo
+};
+#define _CAB_STATS_STORAGE(_name, _num) static struct cab_hold _cab_hold_##_name[(_num)];
+#define _CAB_STATS_INIT(_name) .hold = _cab_hold_##_name,
+#else
+#define _CAB_STATS_STORAGE(_name, _num)
+#define _CAB_STATS_INIT(_name)
+#endif
+
+// state written by every user of the cab, kept apart from the pointers above
+// so that it can live in shared memory
+struct cab_ctl
+{
+    atomic_uint seq; // number of messages published so far
+    // readers sleeping in get_mes_newer until seq changes (a futex on it on
+    // Linux), woken by put_mes
+    atomic_uint waiters;
+#ifdef __ZEPHYR__
+    struct k_sem wake;
+#endif
+#ifdef CAB_STATS
+    struct cab_counters counters;
+#endif
+};
+
+struct cab
+{
+    char *name;
+    int num;
+    size_t dim;
+    size_t stride;    // header + message, CAB_STRIDE(dim)
+    uint8_t *storage; // num buffers of stride bytes
+    // references to each buffer: one for being the latest message, one for
+    // the writer between reserve and put_mes, one per reader. 0 means free.
+    atomic_uint *use;
+    atomic_uint *free_mask; // bit set for every buffer with no reference
+    // the last depth published messages, each (seq << 8 | index), the cab holds
+    // a reference on all of them. hist[seq % depth] is the most recent one.
+    unsigned int depth;
+    atomic_uint *hist;
+    struct cab_ctl *ctl;
+#ifdef CAB_STATS
+    struct cab_hold *hold; // one per buffer
+#endif
+};
+
+// Defines a statically allocated cab of _num buffers of _dim bytes, no heap
+// involved. Call init_cab(&_name, first) once before using it.
+#define CAB_DEFINE(_name, _num, _dim) CAB_DEFINE_HISTORY(_name, _num, _dim, 1)
+
+// Same, keeping the last _depth messages for get_mes_history().
+// _num must be at least _depth + readers * k + 1 for readers pinning k messages.
+#define CAB_DEFINE_HISTORY(_name, _num, _dim, _depth)                      \
+    _Static_assert((_num) > (_depth) && (_num) <= CAB_MAX_BUFFERS,         \
+                   "a cab needs 2 to CAB_MAX_BUFFERS buffers, over depth"); \
+    static uint8_t _cab_storage_##_name[(_num) * CAB_STRIDE(_dim)]         \
+        __attribute__((aligned(CAB_ALIGN)));                               \
+    static atomic_uint _cab_use_##_name[(_num)];                           \
+    static atomic_uint _cab_free_##_name[CAB_MASK_WORDS(_num)];            \
+    static atomic_uint _cab_hist_##_name[(_depth)];                        \
+    static struct cab_ctl _cab_ctl_##_name;                                \
+    _CAB_STATS_STORAGE(_name, _num)                                        \
+    cab _name = {                                                          \
+        .name = #_name,                                                    \
+        .num = (_num),                                                     \
+        .dim = (_dim),                                                     \
+        .stride = CAB_STRIDE(_dim),                                        \
+        .storage = _cab_storage_##_name,                                   \
+        .use = _cab_use_##_name,                                           \
+        .free_mask = _cab_free_##_name,                                    \
+        .depth = (_depth),                                                 \
+        .hist = _cab_hist_##_name,                                         \
+        .ctl = &_cab_ctl_##_name,                                          \
+        _CAB_STATS_INIT(_name)                                             \
+    }
+
+// allocates a cab on the heap, the first message is copied in.
+// On Linux a name starting with '/' is a POSIX shared memory name instead: the
+// first process creates the segment (and copies first in), the others attach
+// to it with the same num, dim and depth. Then processes share messages with
+// no copies, as threads do. A process that dies holding a message leaks it.
 cab * open_cab(char * name, int num, size_t dim, void* first);
 
+// same, keeping the last depth messages for get_mes_history()
+cab * open_cab_history(char * name, int num, size_t dim, unsigned int depth, void* first);
+
+// frees a cab made by open_cab, or unmaps it if it is shared
+void close_cab(cab * cab_id);
+
+#ifndef __ZEPHYR__
+// removes the shared memory name, attached processes keep their mapping
+int unlink_cab(char * name);
+#endif
+
+// initializes a cab defined with CAB_DEFINE, the first message is copied in
+void init_cab(cab * cab_id, void* first);
+
+// returns a free buffer for the writer, NULL if all are held
 void *reserve(cab * cab_id);
 
+// publishes a reserved buffer as the most recent message, without copying it
 void put_mes (void* buf_pointer, cab * cab_id); 
 
+// returns the most recent message, shared with other readers: read only until unget
 void* get_mes (cab * cab_id);
 
 void unget (void* mes_pointer, cab * cab_id); 
 
+// returns the most recent message if it is newer than *seq, otherwise blocks
+// until one is published or timeout_ms expires (NULL, CAB_FOREVER never does).
+// *seq is updated to the sequence number of the returned message, so a jump
+// of more than one tells how many messages were skipped.
+void* get_mes_newer (cab * cab_id, unsigned int * seq, int32_t timeout_ms);
+
+// returns the most recent message if it was published at most max_age ago
+// (cab_time_t units, see CAB_MS), otherwise NULL without holding anything
+void* get_mes_fresh (cab * cab_id, cab_time_t max_age);
+
+// publish time of a message got from the cab, and its sequence number in
+// *seq when seq is not NULL
+cab_time_t cab_mes_time (cab * cab_id, void* mes_pointer, unsigned int * seq);
+
+// pins up to k of the most recent messages, newest first in out[], without
+// copying them. Returns how many were pinned (fewer if less were published or
+// k is over the cab depth); each must be released with unget.
+int get_mes_history (cab * cab_id, int k, void* out[]);
+
+// copies the counters, and when hold is not NULL the hold times of each of the
+// num buffers. Returns -1 (all zero) if built without CAB_STATS.
+int cab_stats (cab * cab_id, struct cab_stats * stats, struct cab_hold_stats * hold);
+
+// current time in cab_time_t units
+cab_time_t cab_now (void);
 
+#endif
@@ -151,8 +151,6 @@ uint8_t vertical_guide_image_data[IMGWIDTH][IMGWIDTH] =
         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}};
 
 
-/* Cab */
-cab* image_cab;
 
 /* Size of stack area used by each thread (can be thread specific, if necessary)*/
 #define STACK_SIZE 1024
@@ -160,6 +158,9 @@ cab* image_cab;
 #define N_PRODUCERS 1
 #define N_CONSUMERS 1
 
+/* Cab */
+CAB_DEFINE(image_cab, N_PRODUCERS + N_CONSUMERS + 1, IMGWIDTH * IMGWIDTH);
+
 /* Create thread stack space */
 K_THREAD_STACK_DEFINE(p1_stack, STACK_SIZE);
 K_THREAD_STACK_DEFINE(c1_stack, STACK_SIZE);
@@ -189,15 +190,7 @@ void main(void) {
 
     /* Initialize CAB*/
 
-    uint8_t **img1 = (uint8_t **)malloc(IMGWIDTH * sizeof(uint8_t *));
-    for (uint8_t j = 0; j < IMGWIDTH; j++)
-        img1[j] = (uint8_t *)malloc(IMGWIDTH * sizeof(uint8_t));
-
-    for (size_t i = 0; i < IMGWIDTH; i++)
-        for (size_t j = 0; j < IMGWIDTH; j++)
-            img1[i][j] = vertical_guide_image_data[i][j];
-
-    image_cab = open_cab("image cab", N_PRODUCERS+N_CONSUMERS+1, IMGWIDTH*IMGWIDTH, (void*)img1);
+    init_cab(&image_cab, (void*)vertical_guide_image_data);
     
     printk("Cab initialized\n");
 
@@ -226,7 +219,7 @@ void producers_code(void *argA , void *argB, void *argC)
         /* Do the workload */          
         
         /* reserve image from CAB */
-        uint8_t *img = (uint8_t *)reserve(image_cab);
+        uint8_t *img = (uint8_t *)reserve(&image_cab);
 
         memcpy(img, vertical_guide_image_data, IMGWIDTH*IMGWIDTH);
 
@@ -234,7 +227,7 @@ void producers_code(void *argA , void *argB, void *argC)
         img[126*IMGWIDTH+60] = 128;
 
 
-        put_mes((void*)img, image_cab);
+        put_mes((void*)img, &image_cab);
         printk("Task producer put image to CAB \n");
 
         k_msleep(1000);
@@ -257,12 +250,12 @@ void producers_code2(void *argA , void *argB, void *argC)
         /* Do the workload */          
         
         /* reserve image from CAB */
-        uint8_t *img = (uint8_t *)reserve(image_cab);
+        uint8_t *img = (uint8_t *)reserve(&image_cab);
 
         memcpy(img, vertical_guide_image_data, IMGWIDTH*IMGWIDTH);
     
 
-        put_mes((void*)img, image_cab);
+        put_mes((void*)img, &image_cab);
         printk("Task producer put image to CAB \n");
         
     }
@@ -277,7 +270,7 @@ void consumers_code(void *argA , void *argB, void *argC)
     while(1) {
 
     /* get image from CAB*/
-    uint8_t *img = (uint8_t *)get_mes(image_cab);
+    uint8_t *img = (uint8_t *)get_mes(&image_cab);
 
     if(img[126*IMGWIDTH+60] == 128){
         printk("Task consumer obstacle detected \n");
@@ -296,7 +289,7 @@ void consumers_code(void *argA , void *argB, void *argC)
     }
 
     /* unget image from CAB*/
-    unget((void*)img, image_cab);
+    unget((void*)img, &image_cab);
 
     k_msleep(1000);
 
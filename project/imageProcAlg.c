@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <math.h>
+#include "imgKernels.h"
 
 /* Some defines that are usefull to make the SW more readable */
 /* and adaptable */
@@ -21,6 +22,7 @@
 #define OBSTACLE_COLOR 0x80		 /* Obstacle color */
 #define GN_ROW (IMGWIDTH - 1)				 /* Row to look for the guiode line - close */
 #define GF_ROW 0	 /* Row to look for the guiode line - far */
+#define GUIDE_STEP 4	 /* Rows between the ones fitted to the guideline */
 #define NOB_ROW (IMGWIDTH / 2)	 /* Row to look for near obstacles */
 #define NOB_COL (IMGWIDTH / 4)	 /* Col to look for near obstacles */
 #define NOB_WIDTH (IMGWIDTH / 2) /* WIDTH of the sensor area */
@@ -300,112 +302,49 @@ uint8_t vertical_guide_image_data[IMGWIDTH][IMGWIDTH] =
 
 
 /* Function that detects he position and agle of the guideline */
-/* Very crude implemenation. Just for illustration purposes */
+/* Least squares line through the guideline pixels of every GUIDE_STEP-th
+ * row, so a row missing the line does not lose it. pos is the measured
+ * pixel at GN_ROW (the fitted one if that row misses the line), the angle
+ * that of the fitted line, or of the GN_ROW/GF_ROW pixels if it is bent */
 int guideLineSearch(uint8_t imageBuf[IMGWIDTH][IMGWIDTH], int16_t *pos, float *angle)
 {
-	int i, gf_pos;
+	struct guide_fit fit;
 
 	/* Inits */
 	*pos = -1;
-	gf_pos = -1;
 
-	/* Search for guideline pos - Near*/
-	for (i = 0; i < IMGWIDTH; i++)
+	if (guideFitImage((const uint8_t(*)[IMGWIDTH])imageBuf, GUIDE_STEP, GN_ROW, GF_ROW, &fit) != 0)
 	{
-		if (imageBuf[GN_ROW][i] == GUIDELINE_COLOR)
-		{
-			*pos = i;
-			break;
-		}
-	}
-
-	/* Search for guideline pos - Far*/
-	for (i = 0; i < IMGWIDTH; i++)
-	{
-		if (imageBuf[GF_ROW][i] == GUIDELINE_COLOR)
-		{
-			gf_pos = i;
-			break;
-		}
-	}
-
-	if (*pos == -1 || gf_pos == -1)
-	{
-		printf("Failed to find guideline pos=%d, gf_pos=%d", *pos, gf_pos);
+		printf("Failed to find guideline, %d rows with guideline pixels", fit.rows);
 		return -1;
 	}
+	*pos = guidePos(&fit);
 
-	if (*pos == gf_pos)
-	{
-		*angle = 0;
-	}
-	else
-	{
-		int pos_delta = gf_pos- *pos;
-		float angle_step = M_PI / 2 / IMGWIDTH;
-		// calculate angle of the guideline 
-		*angle = pos_delta * angle_step;
-		// the angle is in rad print it in degrees
-		printf("\nangle=%f\n", *angle * 180 / M_PI);
-	}
+	// calculate angle of the guideline, atan of the near/far delta
+	*angle = guideAngle(&fit, GN_ROW, GF_ROW) * M_PI / ANGLE_PI;
+	// the angle is in rad print it in degrees
+	printf("\nangle=%f, fit over %d rows, residual %.2f pixels\n", *angle * 180 / M_PI, fit.rows,
+		   fit.residual / 256.0);
 
 	return 0;
 }
 
 /* Function to look for closeby obstacles */
+/* Two or more adjacent obstacle pixels in a row of the sensor area */
 int nearObstSearch(uint8_t imageBuf[IMGWIDTH][IMGWIDTH])
 {
-	int i, j;
-
-	for (j = NOB_ROW; j < IMGWIDTH; j++)
-	{
-		int inObs = 0;
-		for (i = NOB_COL; i < NOB_COL + NOB_WIDTH; i++)
-		{
-			if (imageBuf[j][i] == OBSTACLE_COLOR)
-			{
-				inObs++;
-			}
-			else if (inObs > 1)
-			{
-				inObs = 0;
-			}
-			if (inObs > 1)
-				return 1;
-		}
-	}
-	return 0;
+	return nearObstRuns((const uint8_t(*)[IMGWIDTH])imageBuf);
 }
 
 /* Function that counts obstacles.*/
-int obstCount(uint8_t imageBuf[IMGWIDTH][IMGWIDTH])
-{
-	int i, j, nobs;
-
-	/* Inits */
-	nobs = 0;
+/* Connected groups of obstacle pixels, each one counted once whatever the
+ * number of rows it spans. obs gets up to max_obs of them, labels.dropped
+ * the runs left out because the label table was full */
+static struct label_table labels;
 
-	/* Search for obstacles. Crude version. Only works if one obstacle per row at max*/
-	for (j = 0; j < IMGWIDTH; j++)
-	{
-		int inObs = 0;
-		for (i = 0; i < IMGWIDTH; i++)
-		{
-			if (imageBuf[j][i] == OBSTACLE_COLOR)
-			{
-				inObs++;
-			}
-			else if (inObs > 1)
-			{
-				nobs++;
-				inObs = 0;
-			}
-		}
-		if (inObs > 1)
-			nobs++;
-	}
-
-	return nobs;
+int obstCount(uint8_t imageBuf[IMGWIDTH][IMGWIDTH], struct obstacle *obs, int max_obs)
+{
+	return labelObstacles((const uint8_t(*)[IMGWIDTH])imageBuf, &labels, obs, max_obs);
 }
 
 /* Main function */
@@ -415,6 +354,7 @@ int main()
 
 	int16_t pos;
 	float angle;
+	struct obstacle obs[FRAME_MAX_OBSTACLES];
 
 	FILE* fp = fopen("imageBib/right64", "r");
 
@@ -429,8 +369,13 @@ int main()
 	printf("Robot position=%d, guideline angle = %f\n\r", pos, angle);
 
 	printf("Detecting number of obstacles ...");
-	res = obstCount(raw_image);
+	res = obstCount(raw_image, obs, FRAME_MAX_OBSTACLES);
 	printf("%d obstacles detected\n\r", res);
+	if (labels.dropped != 0)
+		printf("\t%d obstacle runs not labelled, label table full\n\r", labels.dropped);
+	for (int i = 0; i < res && i < FRAME_MAX_OBSTACLES; i++)
+		printf("\t(%d,%d)-(%d,%d), %d pixels, centroid (%d,%d)\n\r", obs[i].x0, obs[i].y0, obs[i].x1, obs[i].y1,
+			   obs[i].area, obs[i].cx, obs[i].cy);
 
 	printf("Detecting closeby obstacles ...");
 	res = nearObstSearch(raw_image);
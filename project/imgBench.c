@@ -0,0 +1,510 @@
+/* ************************************************************
+ * Benchmark of the image kernels over the images/imgN.raw sequence
+ * Times obstacle counting + near obstacle search per frame for
+ * the original pixel loops and every row classifier this CPU
+ * supports, and checks they all agree.
+ * Then times the fused frame analysis, the connected-component
+ * labeller, guideline tracking, the row cache, the guideline fit and
+ * its integer angle, the 1 bpp frame bitmaps and the run-length encoded
+ * kernels.
+ *
+ * usage: imgBench [image dir] [repetitions]
+ ************************************************************** */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "imgKernels.h"
+#include "imgLink.h"
+
+#define MAX_FRAMES 99
+
+uint8_t frames[MAX_FRAMES][IMGWIDTH][IMGWIDTH];
+int nframes;
+struct rle_frame rles[MAX_FRAMES];
+
+/* The original per pixel versions from imageProcAlg.c, as reference */
+int refNearObst(const uint8_t imageBuf[IMGWIDTH][IMGWIDTH])
+{
+	int i, j;
+
+	for (j = NOB_ROW; j < IMGWIDTH; j++)
+	{
+		int inObs = 0;
+		for (i = NOB_COL; i < NOB_COL + NOB_WIDTH; i++)
+		{
+			if (imageBuf[j][i] == OBSTACLE_COLOR)
+				inObs++;
+			else if (inObs > 1)
+				inObs = 0;
+			if (inObs > 1)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+int refObstCount(const uint8_t imageBuf[IMGWIDTH][IMGWIDTH])
+{
+	int i, j, nobs = 0;
+
+	for (j = 0; j < IMGWIDTH; j++)
+	{
+		int inObs = 0;
+		for (i = 0; i < IMGWIDTH; i++)
+		{
+			if (imageBuf[j][i] == OBSTACLE_COLOR)
+				inObs++;
+			else if (inObs > 1)
+			{
+				nobs++;
+				inObs = 0;
+			}
+		}
+		if (inObs > 1)
+			nobs++;
+	}
+	return nobs;
+}
+
+double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int loadFrames(const char *dir)
+{
+	char path[256];
+	for (int i = 1; i <= MAX_FRAMES; i++)
+	{
+		snprintf(path, sizeof(path), "%s/img%d.raw", dir, i);
+		FILE *fp = fopen(path, "rb");
+		if (fp == NULL)
+			break;
+		size_t n = fread(frames[nframes], 1, IMGWIDTH * IMGWIDTH, fp);
+		fclose(fp);
+		if (n == IMGWIDTH * IMGWIDTH)
+			nframes++;
+	}
+	return nframes;
+}
+
+/* Three separate passes over the frame, as the three tasks did */
+long separatePasses(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	uint64_t mask[ROW_WORDS];
+	rowColorMask(img[0], GUIDELINE_COLOR, mask);
+	long near = maskFirst(mask);
+	rowColorMask(img[IMGWIDTH - 1], GUIDELINE_COLOR, mask);
+	return near + maskFirst(mask) + obstCountRuns(img) * 2 + nearObstRuns(img);
+}
+
+long fusedPass(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	struct frame_result res;
+	analyze_frame(img, &res, NULL);
+	return res.guide[0] + res.guide[IMGWIDTH - 1] + res.obstacles * 2 + res.near_obstacle;
+}
+
+/* The same three tasks on the frame bitmaps */
+struct frame_masks masks;
+
+long bitmapPasses(const struct frame_masks *fm)
+{
+	return maskFirst(fm->guide[0]) + maskFirst(fm->guide[IMGWIDTH - 1]) + bitmapObstCount(fm) * 2 +
+		   bitmapNearObst(fm);
+}
+
+long bitmapPass(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	frameMasks(img, &masks);
+	return bitmapPasses(&masks);
+}
+
+/* The same three tasks on the encoded frame */
+long rlePasses(const struct rle_frame *f)
+{
+	return rleGuideFirst(f, 0) + rleGuideFirst(f, IMGWIDTH - 1) + rleObstCount(f) * 2 + rleNearObst(f);
+}
+
+struct label_table labels;
+
+long labelPass(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	struct obstacle obs[FRAME_MAX_OBSTACLES];
+	return labelObstacles(img, &labels, obs, FRAME_MAX_OBSTACLES);
+}
+
+long labelFused(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	struct frame_result res;
+	struct frame_state st = {.labels = &labels};
+	analyze_frame(img, &res, &st);
+	return res.objects;
+}
+
+/* Guideline of every row: full scans or tracked from the previous frame */
+struct guide_tracker tracker;
+
+long guideScan(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	uint64_t mask[ROW_WORDS];
+	long sum = 0;
+	for (int j = 0; j < IMGWIDTH; j++)
+	{
+		rowColorMask(img[j], GUIDELINE_COLOR, mask);
+		sum += maskFirst(mask);
+	}
+	return sum;
+}
+
+long guideTrack(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	long sum = 0;
+	trackBegin(&tracker);
+	for (int j = 0; j < IMGWIDTH; j++)
+		sum += trackRow(&tracker, img[j], j);
+	return sum;
+}
+
+long trackedPass(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	struct frame_result res;
+	struct frame_state st = {.tracker = &tracker};
+	analyze_frame(img, &res, &st);
+	return res.guide[0] + res.guide[IMGWIDTH - 1] + res.obstacles * 2 + res.near_obstacle;
+}
+
+/* Rows memoized by hash, with and without the labeller */
+struct row_cache cache;
+
+long cachedPass(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	struct frame_result res;
+	struct frame_state st = {.cache = &cache};
+	analyze_frame(img, &res, &st);
+	return res.guide[0] + res.guide[IMGWIDTH - 1] + res.obstacles * 2 + res.near_obstacle;
+}
+
+long cachedLabels(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	struct frame_result res;
+	struct frame_state st = {.labels = &labels, .cache = &cache};
+	analyze_frame(img, &res, &st);
+	return res.objects;
+}
+
+/* Times one pass function, returns ns per frame and the sum of its results */
+double timePass(long (*pass)(const uint8_t[IMGWIDTH][IMGWIDTH]), int reps, long *check)
+{
+	volatile long sum = 0;
+	double t0 = now_ns();
+	for (int r = 0; r < reps; r++)
+		for (int f = 0; f < nframes; f++)
+			sum += pass(frames[f]);
+	double t = (now_ns() - t0) / ((double)reps * nframes);
+	*check = sum / reps;
+	return t;
+}
+
+/* Times one version, returns ns per frame; sums results into *check */
+double timeKernels(int ref, int reps, long *check)
+{
+	volatile long sum = 0;
+	double t0 = now_ns();
+	for (int r = 0; r < reps; r++)
+		for (int f = 0; f < nframes; f++)
+		{
+			if (ref)
+				sum += refObstCount(frames[f]) * 2 + refNearObst(frames[f]);
+			else
+				sum += obstCountRuns(frames[f]) * 2 + nearObstRuns(frames[f]);
+		}
+	double t = (now_ns() - t0) / ((double)reps * nframes);
+	*check = sum / reps;
+	return t;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = argc > 1 ? argv[1] : "images";
+	int reps = argc > 2 ? atoi(argv[2]) : 200;
+
+	if (loadFrames(dir) == 0)
+	{
+		printf("no images in %s\n", dir);
+		return 1;
+	}
+
+	long refCheck, check, scalarCheck = 0;
+	double ref = timeKernels(1, reps, &refCheck);
+	printf("%d frames, %d repetitions\n", nframes, reps);
+	printf("%-8s %9.0f ns/frame\n", "original", ref);
+
+	const enum kernelImpl impls[] = {KERNEL_SCALAR, KERNEL_SWAR, KERNEL_SSE2, KERNEL_AVX2};
+	int errors = 0;
+	for (unsigned int k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+	{
+		if (kernelSelect(impls[k]) != 0)
+			continue;
+		double t = timeKernels(0, reps, &check);
+		if (impls[k] == KERNEL_SCALAR)
+			scalarCheck = check;
+		else if (check != scalarCheck)
+			errors++;
+		printf("%-8s %9.0f ns/frame  %5.1fx%s\n", kernelName(), t, ref / t,
+			   check != scalarCheck ? "  MISMATCH" : "");
+	}
+	/* the original loops also count scattered single pixels as runs,
+	   on the generated images both must agree */
+	if (refCheck != scalarCheck)
+		printf("original loops disagree with the run kernels (%ld vs %ld)\n", refCheck, scalarCheck);
+
+	/* the guideline, near obstacle and count tasks: separate passes or one */
+	long sepCheck, fusedCheck;
+	kernelSelect(KERNEL_AUTO);
+	double sep = timePass(separatePasses, reps, &sepCheck);
+	double fused = timePass(fusedPass, reps, &fusedCheck);
+	printf("%s: 3 passes %.0f ns/frame, analyze_frame %.0f ns/frame (every row)%s\n", kernelName(), sep, fused,
+		   sepCheck != fusedCheck ? "  MISMATCH" : "");
+	errors += sepCheck != fusedCheck;
+
+	/* connected obstacles, alone and inside the fused pass */
+	long labelCheck, labelFusedCheck;
+	double label = timePass(labelPass, reps, &labelCheck);
+	double labelF = timePass(labelFused, reps, &labelFusedCheck);
+	long rowRuns = 0;
+	for (int f = 0; f < nframes; f++)
+		rowRuns += obstCountRuns(frames[f]);
+	printf("%s: labeller %.0f ns/frame, analyze_frame with labels %.0f ns/frame, "
+		   "%ld obstacles in %d frames (%ld row runs)%s\n",
+		   kernelName(), label, labelF, labelCheck, nframes, rowRuns,
+		   labelCheck != labelFusedCheck ? "  MISMATCH" : "");
+	errors += labelCheck != labelFusedCheck;
+
+	/* isolated noise pixels do not use up the labels: a 20x20 obstacle
+	   under 70 of them, then under one every other pixel of every other
+	   row of the top half (64 in a row) */
+	for (int dense = 0; dense <= 1; dense++)
+	{
+		static uint8_t img[IMGWIDTH][IMGWIDTH];
+		struct obstacle obs[FRAME_MAX_OBSTACLES];
+		struct frame_result res;
+		struct frame_state st = {.labels = &labels};
+		memset(img, BACKGROUND_COLOR, sizeof(img));
+		for (int i = 0; i < (dense ? IMGWIDTH / 4 * IMGWIDTH / 2 : 70); i++)
+			img[i / (IMGWIDTH / 2) * 2][i % (IMGWIDTH / 2) * 2] = OBSTACLE_COLOR;
+		for (int j = 80; j < 100; j++)
+			memset(&img[j][40], OBSTACLE_COLOR, 20);
+		int n = labelObstacles((const uint8_t(*)[IMGWIDTH])img, &labels, obs, FRAME_MAX_OBSTACLES);
+		analyze_frame((const uint8_t(*)[IMGWIDTH])img, &res, &st);
+		if (n != 1 || labels.dropped != 0 || obs[0].area != 400 || obs[0].x0 != 40 || obs[0].y0 != 80 ||
+			res.objects != 1 || res.dropped != 0)
+		{
+			printf("labeller with %s noise: %d obstacles (%d in analyze_frame), %d runs dropped\n",
+				   dense ? "dense" : "sparse", n, res.objects, labels.dropped);
+			errors++;
+		}
+	}
+
+	/* guideline tracking: the sequence is played in order, as received.
+	   The full scans pay the row classifier, so compare with each one */
+	for (unsigned int k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+	{
+		if (kernelSelect(impls[k]) != 0)
+			continue;
+		long scanCheck, trackCheck;
+		double scan = timePass(guideScan, reps, &scanCheck);
+		trackerInit(&tracker);
+		double track = timePass(guideTrack, reps, &trackCheck);
+		printf("%s: guideline full scan %.0f ns/frame, tracked %.0f ns/frame, %u rows in window, %u rescans (%u "
+			   "reacquired)%s\n",
+			   kernelName(), scan, track, tracker.tracked, tracker.rescans, tracker.reacquired,
+			   trackCheck != scanCheck ? "  MISMATCH" : "");
+		errors += trackCheck != scanCheck;
+	}
+	kernelSelect(KERNEL_AUTO);
+	long trackedCheck;
+	trackerInit(&tracker);
+	double tracked = timePass(trackedPass, reps, &trackedCheck);
+	printf("%s: analyze_frame tracking the guideline %.0f ns/frame%s\n", kernelName(), tracked,
+		   trackedCheck != sepCheck ? "  MISMATCH" : "");
+	errors += trackedCheck != sepCheck;
+
+	/* row cache: hash every row, classify only the ones not seen before.
+	   Hit rate of one cold pass over the sequence, then timed over all
+	   the repetitions */
+	rowCacheInit(&cache);
+	for (int f = 0; f < nframes; f++)
+		cachedPass(frames[f]);
+	printf("row cache: %u entries, %.1f%% of the rows hit on the first pass\n", ROW_CACHE_SIZE,
+		   100.0 * cache.hits / cache.lookups);
+	for (unsigned int k = 0; k < sizeof(impls) / sizeof(impls[0]); k++)
+	{
+		if (kernelSelect(impls[k]) != 0)
+			continue;
+		long fusedK, cachedCheck, labelK, cachedLabelCheck;
+		double plain = timePass(fusedPass, reps, &fusedK);
+		rowCacheInit(&cache);
+		double cached = timePass(cachedPass, reps, &cachedCheck);
+		printf("%s: analyze_frame %.0f ns/frame, with row cache %.0f ns/frame, %.1f%% hits, %.0f ns/frame saved%s\n",
+			   kernelName(), plain, cached, 100.0 * cache.hits / cache.lookups, plain - cached,
+			   cachedCheck != sepCheck ? "  MISMATCH" : "");
+		double labelled = timePass(labelFused, reps, &labelK);
+		rowCacheInit(&cache);
+		double cachedL = timePass(cachedLabels, reps, &cachedLabelCheck);
+		printf("%s: with labels %.0f ns/frame, with labels and row cache %.0f ns/frame%s\n", kernelName(), labelled,
+			   cachedL, cachedLabelCheck != labelCheck ? "  MISMATCH" : "");
+		errors += cachedCheck != sepCheck || cachedLabelCheck != labelCheck;
+	}
+	kernelSelect(KERNEL_AUTO);
+
+	/* guideline fitted over every step-th row, against 2 rows sampled */
+	for (int step = 1; step <= 8; step *= 2)
+	{
+		struct guide_fit fit;
+		long fitted = 0, residual = 0;
+		double t0 = now_ns();
+		for (int r = 0; r < reps; r++)
+			for (int f = 0; f < nframes; f++)
+				fitted += guideFitImage(frames[f], step, IMGWIDTH - 1, 0, &fit) == 0;
+		double t = (now_ns() - t0) / ((double)reps * nframes);
+		for (int f = 0; f < nframes; f++)
+			if (guideFitImage(frames[f], step, IMGWIDTH - 1, 0, &fit) == 0)
+				residual += fit.residual;
+		printf("%s: guideline fit every %d rows %.0f ns/frame, %ld/%d frames, mean residual %.2f pixels\n", kernelName(),
+			   step, t, fitted / reps, nframes, residual / 256.0 / nframes);
+	}
+
+	/* bent and straight guidelines of imageBib: the position is the pixel
+	   measured at the near row, the angle within a degree of the one of
+	   the near/far pixels */
+	static const char *const bib[] = {"left1", "left23", "left64", "right1", "right23", "right64", "vertical"};
+	for (int i = 0; i < (int)(sizeof(bib) / sizeof(bib[0])); i++)
+	{
+		static uint8_t img[IMGWIDTH][IMGWIDTH];
+		char path[64];
+		snprintf(path, sizeof(path), "imageBib/%s", bib[i]);
+		FILE *fp = fopen(path, "rb");
+		if (fp == NULL)
+			continue;
+		size_t n = fread(img, 1, sizeof(img), fp);
+		fclose(fp);
+		if (n != sizeof(img))
+			continue;
+		int near = -1, far = -1;
+		for (int x = IMGWIDTH - 1; x >= 0; x--)
+		{
+			near = img[IMGWIDTH - 1][x] == GUIDELINE_COLOR ? x : near;
+			far = img[0][x] == GUIDELINE_COLOR ? x : far;
+		}
+		double want = atan2(far - near, IMGWIDTH - 1) * 180 / M_PI;
+		for (int step = 1; step <= 8; step *= 2)
+		{
+			struct guide_fit fit;
+			int ok = guideFitImage(img, step, IMGWIDTH - 1, 0, &fit) == 0;
+			double got = guideAngle(&fit, IMGWIDTH - 1, 0) * 180.0 / ANGLE_PI;
+			if (!ok || guidePos(&fit) != near || fabs(got - want) > 1)
+			{
+				printf("%s, fit every %d rows: pos %d angle %.1f, measured pos %d angle %.1f (residual %.2f)\n",
+					   bib[i], step, ok ? guidePos(&fit) : -1, got, near, want, fit.residual / 256.0);
+				errors++;
+			}
+		}
+	}
+
+	/* guideline angle from the atan table, against atan() */
+	double maxErr = 0;
+	for (int dy = 1; dy < 2 * IMGWIDTH; dy++)
+		for (int dx = -2 * IMGWIDTH; dx <= 2 * IMGWIDTH; dx++)
+		{
+			double err = fabs(atanQ15(dx, dy) * M_PI / ANGLE_PI - atan2(dx, dy));
+			maxErr = err > maxErr ? err : maxErr;
+		}
+	printf("atanQ15: max error %.4f degrees\n", maxErr * 180 / M_PI);
+	errors += maxErr * 180 / M_PI > 0.05;
+
+	/* 1 bpp bitmaps: classification pre-pass, then queries on 4 KB */
+	long bitmapCheck;
+	double bitmap = timePass(bitmapPass, reps, &bitmapCheck);
+	frameMasks(frames[0], &masks);
+	volatile long qsum = 0;
+	double tq = now_ns();
+	for (int r = 0; r < reps * nframes; r++)
+		qsum += bitmapPasses(&masks);
+	double query = (now_ns() - tq) / ((double)reps * nframes);
+	printf("%s: bitmaps + 3 tasks %.0f ns/frame, 3 tasks on bitmaps %.0f ns/frame%s\n", kernelName(), bitmap, query,
+		   bitmapCheck != sepCheck ? "  MISMATCH" : "");
+	errors += bitmapCheck != sepCheck;
+
+	/* run-length encoded frames: size, encoder, kernels on the runs */
+	static uint8_t decoded[IMGWIDTH][IMGWIDTH];
+	long runs = 0;
+	for (int f = 0; f < nframes; f++)
+	{
+		int n = rleEncode(frames[f], &rles[f]);
+		rleDecode(&rles[f], decoded);
+		if (n < 0 || memcmp(decoded, frames[f], sizeof(decoded)) != 0)
+		{
+			printf("img%d.raw does not survive run-length encoding\n", f + 1);
+			errors++;
+		}
+		runs += n;
+	}
+	volatile long sum = 0;
+	double t0 = now_ns();
+	for (int r = 0; r < reps; r++)
+		for (int f = 0; f < nframes; f++)
+			sum += rleEncode(frames[f], &rles[f]);
+	double enc = (now_ns() - t0) / ((double)reps * nframes);
+	t0 = now_ns();
+	for (int r = 0; r < reps; r++)
+		for (int f = 0; f < nframes; f++)
+			sum += rlePasses(&rles[f]);
+	double rle = (now_ns() - t0) / ((double)reps * nframes);
+	long rleCheck = 0;
+	for (int f = 0; f < nframes; f++)
+		rleCheck += rlePasses(&rles[f]);
+	printf("rle: %ld runs/frame (%ld bytes), encode %.0f ns/frame, 3 tasks on runs %.0f ns/frame%s\n",
+		   runs / nframes, (long)(sizeof(rles[0].row) + runs / nframes * sizeof(struct rle_run)), enc, rle,
+		   rleCheck != sepCheck ? "  MISMATCH" : "");
+	errors += rleCheck != sepCheck;
+
+	/* serial link: packed size of each image and of its change from the
+	   previous one, as serialTest sends them, and the unpacking cost */
+	static uint8_t packed[2][LINK_PACKED_MAX];
+	long rleBytes = 0, deltaBytes = 0, sentBytes = 0;
+	double unpack = 0;
+	for (int f = 0; f < nframes; f++)
+	{
+		const uint8_t *img = frames[f][0], *prev = f > 0 ? frames[f - 1][0] : NULL;
+		size_t n = linkPack(packed[0], LINK_PACKED_MAX, img, NULL, IMGWIDTH, IMGWIDTH);
+		size_t d = prev != NULL ? linkPack(packed[1], LINK_PACKED_MAX, img, prev, IMGWIDTH, IMGWIDTH) : 0;
+		int ok = n != 0 && linkUnpack(decoded[0], NULL, packed[0], n, IMGWIDTH, IMGWIDTH) == 0 &&
+				 memcmp(decoded, img, sizeof(decoded)) == 0;
+		if (d != 0)
+			ok = ok && linkUnpack(decoded[0], prev, packed[1], d, IMGWIDTH, IMGWIDTH) == 0 &&
+				 memcmp(decoded, img, sizeof(decoded)) == 0;
+		if (!ok)
+		{
+			printf("img%d.raw does not survive link packing\n", f + 1);
+			errors++;
+		}
+		rleBytes += n != 0 ? n : IMGWIDTH * IMGWIDTH;
+		deltaBytes += d != 0 ? d : n != 0 ? n : IMGWIDTH * IMGWIDTH;
+		sentBytes += LINK_OVERHEAD + (d != 0 && d < n ? d : n != 0 ? n : IMGWIDTH * IMGWIDTH);
+		t0 = now_ns();
+		for (int r = 0; r < reps; r++)
+			sum += linkUnpack(decoded[0], d != 0 ? prev : NULL, packed[d != 0], d != 0 ? d : n, IMGWIDTH, IMGWIDTH);
+		unpack += now_ns() - t0;
+	}
+	printf("link: %ld bytes/frame packed, %ld as a change, %ld sent (%.1f frames/s at 115200), unpack %.0f ns/frame\n",
+		   rleBytes / nframes, deltaBytes / nframes, sentBytes / nframes, 11520.0 * nframes / sentBytes,
+		   unpack / ((double)reps * nframes));
+	return errors != 0;
+}
@@ -0,0 +1,323 @@
+/* ************************************************************
+ * Image processing kernels shared by the host tools and the
+ * obstacle detector (src/imgKernels.h is a copy).
+ *
+ * Pixels are classified a whole row at a time into bitmasks
+ * (bit i set = column i has the color). Obstacles are then runs
+ * of 2 or more set bits, found with shifts, ands and popcounts
+ * instead of a branch per pixel.
+ * The row classifier is vectorized: AVX2 or SSE2 on x86,
+ * chosen at run time, 32-bit SWAR words elsewhere (Cortex-M),
+ * with a plain scalar loop as fallback.
+ ************************************************************** */
+
+#ifndef IMG_KERNELS_H
+#define IMG_KERNELS_H
+
+#include <stdint.h>
+
+#ifndef IMGWIDTH
+#define IMGWIDTH 128 /* Square image. Side size, in pixels*/
+#endif
+#ifndef GUIDELINE_COLOR
+#define GUIDELINE_COLOR 0xFF /* Guideline color */
+#endif
+#ifndef OBSTACLE_COLOR
+#define OBSTACLE_COLOR 0x80 /* Color of the obstacles */
+#endif
+#ifndef NOB_ROW
+#define NOB_ROW (IMGWIDTH / 2) /* Row to look for near obstacles */
+#endif
+#ifndef NOB_COL
+#define NOB_COL (IMGWIDTH / 4) /* Col to look for near obstacles */
+#endif
+#ifndef NOB_WIDTH
+#define NOB_WIDTH (IMGWIDTH / 2) /* WIDTH of the sensor area */
+#endif
+
+/* Words of a row bitmask */
+#define ROW_WORDS (IMGWIDTH / 64)
+
+/* Row classifiers */
+enum kernelImpl
+{
+	KERNEL_AUTO,   /* best one the CPU supports */
+	KERNEL_SCALAR, /* one pixel at a time */
+	KERNEL_SWAR,   /* 4 pixels per 32-bit word */
+	KERNEL_SSE2,   /* 16 pixels per instruction */
+	KERNEL_AVX2,   /* 32 pixels per instruction */
+};
+
+/* Selects the row classifier, returns -1 if this CPU/build lacks it */
+int kernelSelect(enum kernelImpl impl);
+
+/* Name of the row classifier in use */
+const char *kernelName(void);
+
+/* Bitmask of the pixels of row that have the given color */
+void rowColorMask(const uint8_t *row, uint8_t color, uint64_t mask[ROW_WORDS]);
+
+/* Number of runs of 2 or more set bits in a row bitmask */
+int maskRuns(const uint64_t mask[ROW_WORDS]);
+
+/* Column of the first set bit of a row bitmask, -1 if none */
+int maskFirst(const uint64_t mask[ROW_WORDS]);
+
+/* Number of obstacles, counted as runs of 2 or more obstacle pixels per row */
+int obstCountRuns(const uint8_t img[IMGWIDTH][IMGWIDTH]);
+
+/* 1 if the near-obstacle window (NOB_ROW.., NOB_COL..NOB_COL+NOB_WIDTH)
+ * holds 2 or more adjacent obstacle pixels in a row, 0 otherwise */
+int nearObstRuns(const uint8_t img[IMGWIDTH][IMGWIDTH]);
+
+/* Bitmask of columns x0 .. x1 - 1 */
+void colsMask(int x0, int x1, uint64_t mask[ROW_WORDS]);
+
+/* Runs of set bits of a row bitmask, first and last column of each.
+ * Returns how many, at most IMGWIDTH / 2 */
+int maskRunList(const uint64_t mask[ROW_WORDS], uint8_t start[], uint8_t end[]);
+
+/* Obstacle found by the connected-component labeller */
+struct obstacle
+{
+	uint8_t x0, y0, x1, y1; /* bounding box, inclusive */
+	uint16_t area;          /* pixels */
+	uint8_t cx, cy;         /* centroid, rounded */
+};
+
+/* Labels in use at a time. When the table is full the labels of merged
+ * components and of single pixels that ended are recycled, so it is the
+ * real obstacles and the ones still open that must fit; runs that find
+ * no label even then are dropped and counted in label_table.dropped */
+#ifndef MAX_LABELS
+#define MAX_LABELS 64 /* at most 255 */
+#endif
+#define NO_LABEL 0xFF
+
+/* State of the labeller: union-find over the obstacle runs of each row,
+ * bounded, no heap. About 1.5 KB, keep it off small thread stacks */
+struct label_table
+{
+	int nlabels;
+	int dropped; /* runs dropped because the table was full */
+	uint8_t parent[MAX_LABELS]; /* NO_LABEL once recycled */
+	int nfree;
+	uint8_t free[MAX_LABELS]; /* recycled labels */
+	struct
+	{
+		uint8_t x0, y0, x1, y1;
+		uint16_t area;
+		uint16_t first;  /* row * IMGWIDTH + column of the first pixel, for the order */
+		uint32_t sx, sy; /* sums of the coordinates, for the centroid */
+	} acc[MAX_LABELS];
+	/* runs of the previous and current row */
+	int nruns[2];
+	uint8_t start[2][IMGWIDTH / 2], end[2][IMGWIDTH / 2], label[2][IMGWIDTH / 2];
+};
+
+/* Labeller fed one row mask at a time, rows in order */
+void labelBegin(struct label_table *t);
+void labelRow(struct label_table *t, int row, const uint64_t mask[ROW_WORDS]);
+/* Writes up to max_obs obstacles (8-connected, 2 or more pixels) in the
+ * order their first pixel is met and returns how many there are */
+int labelEnd(struct label_table *t, struct obstacle *obs, int max_obs);
+
+/* Connected obstacles of a frame, one pass, O(pixels) */
+int labelObstacles(const uint8_t img[IMGWIDTH][IMGWIDTH], struct label_table *t, struct obstacle *obs, int max_obs);
+
+/* Guideline tracking: the line moves a few pixels between frames, so
+ * each row is searched outward from where the line was, within
+ * TRACK_WINDOW columns, and fully scanned only when it is not there. */
+#ifndef TRACK_BANDS
+#define TRACK_BANDS 8 /* row bands remembered between frames */
+#endif
+#ifndef TRACK_WINDOW
+#define TRACK_WINDOW 8 /* columns searched each side of the last position */
+#endif
+
+struct guide_tracker
+{
+	int16_t band[TRACK_BANDS]; /* column at the first row of each band last frame, -1 if lost */
+	int16_t prev;              /* column at the previous row of this frame */
+	int16_t prev_row;          /* that row, -1 at the start of a frame */
+	/* rows found in the window, fully scanned, found by the full scan */
+	uint32_t tracked, rescans, reacquired;
+};
+
+void trackerInit(struct guide_tracker *t);
+/* Starts a frame, rows are then given in increasing order */
+void trackBegin(struct guide_tracker *t);
+/* Column of the guideline in row j, -1 if none. In the window this is
+ * the guideline pixel nearest to the last position (left end of its run),
+ * after a full scan the first one of the row */
+int trackRow(struct guide_tracker *t, const uint8_t *row, int j);
+
+/* Obstacles kept in a frame_result */
+#define FRAME_MAX_OBSTACLES 8
+
+/* Everything the detector needs from one frame, filled in a single pass */
+struct frame_result
+{
+	int16_t guide[IMGWIDTH]; /* first guideline column of each row, -1 if none */
+	uint8_t runs[IMGWIDTH];  /* obstacle runs (2 or more pixels) of each row */
+	uint16_t obstacles;      /* sum of runs, as obstCountRuns */
+	uint8_t near_obstacle;   /* as nearObstRuns */
+	uint8_t objects;         /* connected obstacles, as labelObstacles */
+	uint8_t dropped;         /* obstacle runs the labeller had no label for */
+	struct obstacle obstacle[FRAME_MAX_OBSTACLES]; /* the first ones found */
+};
+
+/* Row results memoized by a 64-bit hash of the row: consecutive frames
+ * share most rows, only the ones that changed are classified again.
+ * Direct mapped, a colliding row just replaces the entry.
+ * Hashing reads the whole row, so it only pays off when classifying a
+ * row costs more than hashing it: with the scalar and SWAR kernels (the
+ * nRF52840 has no SIMD), hardly with SSE2, and AVX2 classifies a row
+ * faster than it is hashed (see imgBench). */
+#ifndef ROW_CACHE_SIZE
+#define ROW_CACHE_SIZE 256 /* entries, a power of 2, 32 bytes each */
+#endif
+
+struct row_entry
+{
+	uint64_t hash;              /* 0 = empty */
+	uint64_t obst[ROW_WORDS];   /* obstacle mask, for the labeller */
+	int16_t guide;              /* first guideline column, -1 if none */
+	uint8_t runs;               /* as maskRuns */
+	uint8_t near;               /* obstacle run inside the near-obstacle window */
+};
+
+struct row_cache
+{
+	struct row_entry entry[ROW_CACHE_SIZE];
+	uint32_t lookups, hits;
+};
+
+void rowCacheInit(struct row_cache *c);
+
+/* 64-bit hash of a row, never 0 */
+uint64_t rowHash(const uint8_t *row);
+
+/* State analyze_frame keeps between frames, each one optional (NULL):
+ *   labels  - connected obstacles are labelled (objects = 0 otherwise)
+ *   tracker - the guideline is tracked instead of classifying every row
+ *   cache   - rows seen before are not classified again; the cached
+ *             guideline is the first of the row, the tracker is not used */
+struct frame_state
+{
+	struct label_table *labels;
+	struct guide_tracker *tracker;
+	struct row_cache *cache;
+};
+
+/* Streams the frame once, row by row, and fills res. st may be NULL */
+void analyze_frame(const uint8_t img[IMGWIDTH][IMGWIDTH], struct frame_result *res, const struct frame_state *st);
+
+/* Guideline fitted over many rows by least squares, x = a + b * y,
+ * in fixed point. One row missing the line no longer loses it. */
+struct guide_fit
+{
+	int16_t pos;       /* fitted column at the near row */
+	int16_t far;       /* fitted column at the far row */
+	int16_t near_px;   /* measured column at the near row, -1 if none */
+	int16_t far_px;    /* measured column at the far row, -1 if none */
+	int32_t slope;     /* columns per row, Q16 */
+	uint16_t residual; /* RMS distance of the rows to the line, Q8 pixels */
+	uint8_t rows;      /* rows that had guideline pixels */
+};
+
+/* Incremental sums of the fit */
+struct line_sums
+{
+	int32_t n, sy, sx, syy, sxy, sxx;
+};
+
+void lineSumsInit(struct line_sums *s);
+void lineSumsAdd(struct line_sums *s, int y, int x);
+/* Solves the fit, returns -1 with less than 2 rows */
+int lineSumsFit(const struct line_sums *s, int near_row, int far_row, struct guide_fit *fit);
+
+/* Fits the first guideline column of every step-th row, from the
+ * guide[] of a frame_result or straight from the frame */
+int guideFit(const int16_t guide[IMGWIDTH], int step, int near_row, int far_row, struct guide_fit *fit);
+int guideFitImage(const uint8_t img[IMGWIDTH][IMGWIDTH], int step, int near_row, int far_row, struct guide_fit *fit);
+
+/* A bent guideline is not a line: above this RMS residual (Q8 pixels)
+ * the angle comes from the measured near and far points */
+#define GUIDE_MAX_RESIDUAL (2 * 256)
+
+/* Guideline position: the measured column at the near row, the fitted
+ * one when that row missed the line */
+int guidePos(const struct guide_fit *fit);
+/* Guideline angle (Q15, see atanQ15) between the near and far rows */
+int16_t guideAngle(const struct guide_fit *fit, int near_row, int far_row);
+
+/* Angles are Q15 fractions of pi, 16384 is pi/2 (90 degrees) */
+#define ANGLE_PI 32768
+
+/* atan(dx / dy) for dy >= 0, from a lookup table, integers only */
+int16_t atanQ15(int32_t dx, int32_t dy);
+
+/* Whole frame bitmaps, 1 bit per pixel (2 KB each for 128x128)
+ * Built once, they keep the frame 8 times smaller in the cache and
+ * region queries become ands and popcounts over 64-bit words. */
+struct frame_masks
+{
+	uint64_t obst[IMGWIDTH][ROW_WORDS];  /* OBSTACLE_COLOR pixels */
+	uint64_t guide[IMGWIDTH][ROW_WORDS]; /* GUIDELINE_COLOR pixels */
+};
+
+/* Classifies the whole frame */
+void frameMasks(const uint8_t img[IMGWIDTH][IMGWIDTH], struct frame_masks *fm);
+
+/* Set pixels of a bitmap in columns x0 .. x1 - 1 of rows y0 .. y1 - 1 */
+int bitmapCount(const uint64_t bm[IMGWIDTH][ROW_WORDS], int x0, int y0, int x1, int y1);
+
+/* As obstCountRuns and nearObstRuns, on the bitmaps. The guideline of a
+ * row is maskFirst(fm->guide[row]) */
+int bitmapObstCount(const struct frame_masks *fm);
+int bitmapNearObst(const struct frame_masks *fm);
+
+/* Run-length encoded frames
+ * Only the runs that are not background are kept, so a sparse frame
+ * (thin guideline, a few obstacles) is a few hundred bytes and the
+ * kernels below only visit its runs. */
+#ifndef BACKGROUND_COLOR
+#define BACKGROUND_COLOR 0x00
+#endif
+#ifndef RLE_MAX_RUNS
+#define RLE_MAX_RUNS 1024 /* runs per frame, frames needing more are not encoded */
+#endif
+
+/* Pixels start..start+len-1 of a row have color */
+struct rle_run
+{
+	uint8_t start;
+	uint8_t len; /* 1..IMGWIDTH */
+	uint8_t color;
+};
+
+struct rle_frame
+{
+	uint16_t row[IMGWIDTH + 1]; /* runs of row j are run[row[j]] .. run[row[j + 1] - 1] */
+	struct rle_run run[RLE_MAX_RUNS];
+};
+
+/* Runs of a frame */
+#define RLE_RUNS(f) ((f)->row[IMGWIDTH])
+
+/* Encodes img into f, returns the number of runs or -1 if it needs more
+ * than RLE_MAX_RUNS */
+int rleEncode(const uint8_t img[IMGWIDTH][IMGWIDTH], struct rle_frame *f);
+
+/* Rebuilds the frame */
+void rleDecode(const struct rle_frame *f, uint8_t img[IMGWIDTH][IMGWIDTH]);
+
+/* Column of the first guideline pixel of row, -1 if none */
+int rleGuideFirst(const struct rle_frame *f, int row);
+
+/* As obstCountRuns and nearObstRuns, on the runs */
+int rleObstCount(const struct rle_frame *f);
+int rleNearObst(const struct rle_frame *f);
+
+#endif
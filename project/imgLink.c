@@ -0,0 +1,524 @@
+/* ************************************************************
+ * Framed image transport, see imgLink.h
+ * This file is shared by serialTest and the Zephyr app
+ * (src/imgLink.c is a copy).
+ ************************************************************** */
+
+#include <stdint.h>
+#include <string.h>
+#include "imgLink.h"
+
+/* Parser states */
+enum
+{
+	LINK_HUNT,    /* looking for the sync word */
+	LINK_HEAD,    /* rest of the header */
+	LINK_PAYLOAD,
+	LINK_TAIL,    /* CRC */
+};
+
+static const uint8_t linkSync[4] = {0xA5, 0x5A, 0xC3, 0x3C};
+
+/* CRC-32 of every byte value, polynomial 0xEDB88320 (reflected) */
+static const uint32_t crcTable[256] = {
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F,
+	0xE963A535, 0x9E6495A3, 0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+	0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91, 0x1DB71064, 0x6AB020F2,
+	0xF3B97148, 0x84BE41DE, 0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+	0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC, 0x14015C4F, 0x63066CD9,
+	0xFA0F3D63, 0x8D080DF5, 0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+	0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B, 0x35B5A8FA, 0x42B2986C,
+	0xDBBBC9D6, 0xACBCF940, 0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+	0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116, 0x21B4F4B5, 0x56B3C423,
+	0xCFBA9599, 0xB8BDA50F, 0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+	0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D, 0x76DC4190, 0x01DB7106,
+	0x98D220BC, 0xEFD5102A, 0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+	0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818, 0x7F6A0DBB, 0x086D3D2D,
+	0x91646C97, 0xE6635C01, 0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+	0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457, 0x65B0D9C6, 0x12B7E950,
+	0x8BBEB8EA, 0xFCB9887C, 0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+	0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2, 0x4ADFA541, 0x3DD895D7,
+	0xA4D1C46D, 0xD3D6F4FB, 0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+	0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9, 0x5005713C, 0x270241AA,
+	0xBE0B1010, 0xC90C2086, 0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+	0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4, 0x59B33D17, 0x2EB40D81,
+	0xB7BD5C3B, 0xC0BA6CAD, 0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+	0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683, 0xE3630B12, 0x94643B84,
+	0x0D6D6A3E, 0x7A6A5AA8, 0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+	0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE, 0xF762575D, 0x806567CB,
+	0x196C3671, 0x6E6B06E7, 0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+	0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5, 0xD6D6A3E8, 0xA1D1937E,
+	0x38D8C2C4, 0x4FDFF252, 0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+	0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60, 0xDF60EFC3, 0xA867DF55,
+	0x316E8EEF, 0x4669BE79, 0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+	0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F, 0xC5BA3BBE, 0xB2BD0B28,
+	0x2BB45A92, 0x5CB36A04, 0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+	0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A, 0x9C0906A9, 0xEB0E363F,
+	0x72076785, 0x05005713, 0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+	0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21, 0x86D3D2D4, 0xF1D4E242,
+	0x68DDB3F8, 0x1FDA836E, 0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+	0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C, 0x8F659EFF, 0xF862AE69,
+	0x616BFFD3, 0x166CCF45, 0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+	0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB, 0xAED16A4A, 0xD9D65ADC,
+	0x40DF0B66, 0x37D83BF0, 0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+	0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6, 0xBAD03605, 0xCDD70693,
+	0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+uint32_t linkCrc32(uint32_t crc, const uint8_t *p, size_t n)
+{
+	crc = ~crc;
+	while (n--)
+		crc = crcTable[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+size_t linkHeader(uint8_t out[LINK_HDR_SIZE], const struct link_hdr *h)
+{
+	memcpy(out, linkSync, 4);
+	put16(out + 4, h->width);
+	put16(out + 6, h->height);
+	put16(out + 8, h->seq);
+	put16(out + 10, h->flags);
+	put32(out + 12, h->len);
+	put16(out + 16, linkCrc32(0, out, 16));
+	return LINK_HDR_SIZE;
+}
+
+size_t linkFrame(uint8_t *out, const struct link_hdr *h, const uint8_t *payload)
+{
+	size_t n = linkHeader(out, h);
+	memcpy(out + n, payload, h->len);
+	n += h->len;
+	put32(out + n, linkCrc32(0, out, n));
+	return n + LINK_CRC_SIZE;
+}
+
+void linkInit(struct link_parser *p, uint32_t max_len, uint8_t *(*buffer)(void *, const struct link_hdr *),
+			  void (*done)(void *, uint8_t *, const struct link_hdr *, int), void *ctx)
+{
+	memset(p, 0, sizeof(*p));
+	p->buffer = buffer;
+	p->done = done;
+	p->ctx = ctx;
+	p->max_len = max_len;
+	p->state = LINK_HUNT;
+}
+
+/* Feeds again the payload of a failed frame, where the real next sync
+ * word may be. Only one level: a bad CRC found while replaying just goes
+ * on hunting */
+static void linkReplay(struct link_parser *p, const uint8_t *data, size_t n)
+{
+	if (p->replaying)
+	{
+		p->hunted += n;
+		return;
+	}
+	p->replaying = 1;
+	linkParse(p, data, n);
+	p->replaying = 0;
+}
+
+/* A complete header: checks it and gets the payload a buffer */
+static void linkHead(struct link_parser *p)
+{
+	p->hdr.width = get16(p->head + 4);
+	p->hdr.height = get16(p->head + 6);
+	p->hdr.seq = get16(p->head + 8);
+	p->hdr.flags = get16(p->head + 10);
+	p->hdr.len = get32(p->head + 12);
+	if (get16(p->head + 16) != (linkCrc32(0, p->head, 16) & 0xFFFF) || p->hdr.len > p->max_len)
+	{
+		uint8_t head[LINK_HDR_SIZE];
+		p->bad_headers++;
+		p->state = LINK_HUNT;
+		p->have = 0;
+		memcpy(head, p->head, LINK_HDR_SIZE);
+		/* 17 bytes cannot hold a whole header, so this does not recurse */
+		linkParse(p, head + 1, LINK_HDR_SIZE - 1);
+		return;
+	}
+	p->crc = linkCrc32(0, p->head, LINK_HDR_SIZE);
+	p->buf = p->buffer(p->ctx, &p->hdr);
+	if (p->buf == NULL)
+		p->skipped++;
+	p->state = p->hdr.len > 0 ? LINK_PAYLOAD : LINK_TAIL;
+	p->have = 0;
+}
+
+/* A complete frame */
+static void linkTail(struct link_parser *p)
+{
+	uint8_t *buf = p->buf;
+	struct link_hdr hdr = p->hdr;
+
+	p->state = LINK_HUNT;
+	p->have = 0;
+	if (get32(p->tail) == p->crc)
+	{
+		p->frames++;
+		if (hdr.flags == LINK_CTRL)
+			p->ctrl_frames++;
+		if (buf != NULL)
+			p->done(p->ctx, buf, &hdr, 1);
+		return;
+	}
+	if (buf == NULL)
+	{
+		/* skipped, its bytes are not kept to hunt through */
+		p->crc_errors++;
+		return;
+	}
+
+	/* the buffer still holds the payload: hunt through the frame again */
+	uint8_t head[LINK_HDR_SIZE], tail[LINK_CRC_SIZE];
+	p->crc_errors++;
+	memcpy(head, p->head, LINK_HDR_SIZE);
+	memcpy(tail, p->tail, LINK_CRC_SIZE);
+	linkParse(p, head + 1, LINK_HDR_SIZE - 1);
+	linkReplay(p, buf, hdr.len);
+	linkReplay(p, tail, LINK_CRC_SIZE);
+	p->done(p->ctx, buf, &hdr, 0);
+}
+
+void linkParse(struct link_parser *p, const uint8_t *data, size_t n)
+{
+	size_t i = 0;
+	while (i < n)
+	{
+		size_t k;
+		switch (p->state)
+		{
+		case LINK_HUNT:
+			if (p->have == 0)
+			{
+				/* skip to the next first byte of the sync word */
+				const uint8_t *s = memchr(data + i, linkSync[0], n - i);
+				k = s != NULL ? (size_t)(s - (data + i)) : n - i;
+				p->hunted += k;
+				i += k;
+				if (s == NULL)
+					break;
+			}
+			if (data[i] == linkSync[p->have])
+			{
+				p->head[p->have++] = data[i++];
+				if (p->have == 4)
+					p->state = LINK_HEAD;
+			}
+			else
+			{
+				/* no prefix of the sync word is also a suffix of it */
+				p->hunted += p->have;
+				p->have = 0;
+			}
+			break;
+
+		case LINK_HEAD:
+			k = LINK_HDR_SIZE - p->have < n - i ? LINK_HDR_SIZE - p->have : n - i;
+			memcpy(p->head + p->have, data + i, k);
+			p->have += k;
+			i += k;
+			if (p->have == LINK_HDR_SIZE)
+				linkHead(p);
+			break;
+
+		case LINK_PAYLOAD:
+			k = p->hdr.len - p->have < n - i ? p->hdr.len - p->have : n - i;
+			p->crc = linkCrc32(p->crc, data + i, k);
+			if (p->buf != NULL)
+				memcpy(p->buf + p->have, data + i, k);
+			p->have += k;
+			i += k;
+			if (p->have == p->hdr.len)
+			{
+				p->state = LINK_TAIL;
+				p->have = 0;
+			}
+			break;
+
+		case LINK_TAIL:
+			k = LINK_CRC_SIZE - p->have < n - i ? LINK_CRC_SIZE - p->have : n - i;
+			memcpy(p->tail + p->have, data + i, k);
+			p->have += k;
+			i += k;
+			if (p->have == LINK_CRC_SIZE)
+				linkTail(p);
+			break;
+		}
+	}
+}
+
+const uint32_t linkRates[LINK_NRATES] = {115200, 230400, 460800, 921600, 1000000, 2000000};
+
+size_t linkCtrlFrame(uint8_t out[LINK_CTRL_SIZE + LINK_OVERHEAD], const struct link_ctrl *c)
+{
+	uint8_t payload[LINK_CTRL_SIZE] = {c->type, c->flow};
+	struct link_hdr h = {.flags = LINK_CTRL, .len = LINK_CTRL_SIZE};
+	put32(payload + 4, c->baud);
+	put32(payload + 8, c->frames);
+	put32(payload + 12, c->crc_errors);
+	put32(payload + 16, c->skipped);
+	return linkFrame(out, &h, payload);
+}
+
+int linkCtrlRead(struct link_ctrl *c, const struct link_hdr *h, const uint8_t *payload)
+{
+	if (h->flags != LINK_CTRL || h->len != LINK_CTRL_SIZE)
+		return -1;
+	c->type = payload[0];
+	c->flow = payload[1];
+	c->baud = get32(payload + 4);
+	c->frames = get32(payload + 8);
+	c->crc_errors = get32(payload + 12);
+	c->skipped = get32(payload + 16);
+	return 0;
+}
+
+/* Run token colors */
+static const uint8_t runColor[3] = {0x00, 0x80, 0xFF};
+
+size_t linkPack(uint8_t *out, size_t max, const uint8_t *img, const uint8_t *ref, int width, int height)
+{
+	size_t n = 0;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width;)
+		{
+			int i = y * width + x;
+			uint8_t v = ref != NULL ? img[i] ^ ref[i] : img[i];
+			int len = 1;
+			while (x + len < width && len < 64 && (ref != NULL ? img[i + len] ^ ref[i + len] : img[i + len]) == v)
+				len++;
+			int code = v == 0x00 ? 0 : v == 0x80 ? 1 : v == 0xFF ? 2 : 3;
+			if (n + 1 + (code == 3) > max)
+				return 0;
+			out[n++] = code << 6 | (len - 1);
+			if (code == 3)
+				out[n++] = v;
+			x += len;
+		}
+	return n;
+}
+
+int linkUnpack(uint8_t *img, const uint8_t *ref, const uint8_t *in, size_t len, int width, int height)
+{
+	size_t n = 0;
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width;)
+		{
+			if (n >= len)
+				return -1;
+			int code = in[n] >> 6, run = (in[n++] & 0x3F) + 1;
+			uint8_t v;
+			if (code == 3)
+			{
+				if (n >= len)
+					return -1;
+				v = in[n++];
+			}
+			else
+				v = runColor[code];
+			if (x + run > width)
+				return -1;
+			uint8_t *p = img + y * width + x;
+			if (ref == NULL)
+				memset(p, v, run);
+			else if (v == 0)
+				memcpy(p, ref + y * width + x, run);
+			else
+				for (int i = 0; i < run; i++)
+					p[i] = ref[y * width + x + i] ^ v;
+			x += run;
+		}
+	return n == len ? 0 : -1;
+}
+
+#ifdef LINK_SELFTEST
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_FRAMES 12
+#define TEST_LEN 1000
+
+/* a few payload buffers, as the cab would give them */
+static uint8_t pool[3][TEST_LEN];
+static int busy[3];
+static int received[TEST_FRAMES], bad;
+
+static uint8_t *testBuffer(void *ctx, const struct link_hdr *h)
+{
+	if (h->flags == LINK_CTRL)
+		return NULL; /* skipped */
+	for (int b = 0; b < 3; b++)
+		if (!busy[b])
+		{
+			busy[b] = 1;
+			return pool[b];
+		}
+	return NULL;
+}
+
+static void testDone(void *ctx, uint8_t *buf, const struct link_hdr *h, int ok)
+{
+	busy[(buf - pool[0]) / TEST_LEN] = 0;
+	if (!ok)
+		return;
+	/* payload byte i of frame seq is seq + i */
+	for (uint32_t i = 0; i < h->len; i++)
+		if (buf[i] != (uint8_t)(h->seq + i))
+		{
+			bad++;
+			return;
+		}
+	if (h->seq < TEST_FRAMES)
+		received[h->seq]++;
+}
+
+int main(void)
+{
+	static uint8_t stream[TEST_FRAMES * (TEST_LEN + LINK_OVERHEAD + 50)], payload[TEST_LEN];
+	size_t n = 0;
+	struct link_parser p;
+	int errors = 0;
+
+	if (linkCrc32(0, (const uint8_t *)"123456789", 9) != 0xCBF43926)
+	{
+		printf("wrong CRC-32\n");
+		errors++;
+	}
+
+	/* frame 2 corrupted, frame 5 cut short, frame 8 with a bad header,
+	   a control frame after frame 3, garbage and false sync words between
+	   frames */
+	for (int f = 0; f < TEST_FRAMES; f++)
+	{
+		struct link_hdr h = {.width = 128, .height = 128, .seq = f, .flags = LINK_RAW, .len = TEST_LEN};
+		for (int i = 0; i < TEST_LEN; i++)
+			payload[i] = f + i;
+		size_t start = n;
+		n += linkFrame(stream + n, &h, payload);
+		if (f == 2)
+			stream[start + LINK_HDR_SIZE + 100] ^= 0x10;
+		if (f == 5)
+			n -= 300;
+		if (f == 8)
+			stream[start + 12] ^= 1;
+		if (f == 3)
+		{
+			struct link_ctrl c = {.type = LINK_REPORT};
+			n += linkCtrlFrame(stream + n, &c);
+		}
+		for (int g = 0; g < 20; g++)
+			stream[n++] = g & 1 ? 0xA5 : rand();
+		memcpy(stream + n, linkSync, 4);
+		n += 4;
+	}
+
+	/* fed in chunks of random size, as the UART delivers them */
+	linkInit(&p, TEST_LEN, testBuffer, testDone, NULL);
+	for (size_t i = 0; i < n;)
+	{
+		size_t k = 1 + rand() % 300;
+		k = k < n - i ? k : n - i;
+		linkParse(&p, stream + i, k);
+		i += k;
+	}
+
+	for (int f = 0; f < TEST_FRAMES; f++)
+	{
+		int expected = f != 2 && f != 5 && f != 8;
+		if (received[f] != expected)
+		{
+			printf("frame %d received %d times, expected %d\n", f, received[f], expected);
+			errors++;
+		}
+	}
+	if (bad != 0 || p.crc_errors != 2 || p.bad_headers == 0)
+	{
+		printf("%d bad payloads accepted, %u CRC errors, %u bad headers\n", bad, p.crc_errors, p.bad_headers);
+		errors++;
+	}
+	if (p.frames != TEST_FRAMES - 3 + 1 || p.ctrl_frames != 1 || p.skipped != 1)
+	{
+		printf("%u frames, %u control frames, %u skipped\n", p.frames, p.ctrl_frames, p.skipped);
+		errors++;
+	}
+	/* packing: an image with a guideline, obstacles and odd values, and
+	   the change to the next one */
+	static uint8_t img[2][128 * 128], out[128 * 128], packed[LINK_PACKED_MAX];
+	for (int k = 0; k < 2; k++)
+		for (int y = 0; y < 128; y++)
+			for (int x = 0; x < 128; x++)
+			{
+				uint8_t v = 0x00;
+				if ((x / 16 + y / 16 + k) % 5 == 0 && x % 16 < 6)
+					v = 0x80;
+				if (x == 60 + y / 8 + k)
+					v = 0xFF;
+				if (y == 100 && x < 5)
+					v = x * 37;
+				img[k][y * 128 + x] = v;
+			}
+	size_t rle = linkPack(packed, sizeof(packed), img[0], NULL, 128, 128);
+	if (rle == 0 || linkUnpack(out, NULL, packed, rle, 128, 128) != 0 || memcmp(out, img[0], sizeof(out)) != 0)
+	{
+		printf("image does not survive packing (%zu bytes)\n", rle);
+		errors++;
+	}
+	size_t delta = linkPack(packed, sizeof(packed), img[1], img[0], 128, 128);
+	if (delta == 0 || linkUnpack(out, img[0], packed, delta, 128, 128) != 0 || memcmp(out, img[1], sizeof(out)) != 0)
+	{
+		printf("image change does not survive packing (%zu bytes)\n", delta);
+		errors++;
+	}
+	if (linkUnpack(out, img[0], packed, delta - 1, 128, 128) == 0 || linkPack(packed, 100, img[0], NULL, 128, 128) != 0)
+	{
+		printf("packing does not check sizes\n");
+		errors++;
+	}
+	/* control messages */
+	struct link_ctrl c = {.type = LINK_REPORT, .flow = LINK_FLOW_RTS_CTS, .baud = 1000000, .frames = 70000,
+						  .crc_errors = 3, .skipped = 12},
+					 back;
+	struct link_hdr h = {.flags = LINK_CTRL, .len = LINK_CTRL_SIZE};
+	n = linkCtrlFrame(stream, &c);
+	if (n != LINK_CTRL_SIZE + LINK_OVERHEAD || linkCtrlRead(&back, &h, stream + LINK_HDR_SIZE) != 0 ||
+		back.type != c.type || back.flow != c.flow || back.baud != c.baud || back.frames != c.frames ||
+		back.crc_errors != c.crc_errors || back.skipped != c.skipped)
+	{
+		printf("control message does not survive its frame\n");
+		errors++;
+	}
+
+	printf("pack: %zu bytes, %zu bytes as a change, of %d\n", rle, delta, 128 * 128);
+
+	printf("link: %u frames, %u CRC errors, %u bad headers, %u skipped, %u bytes hunted\n", p.frames, p.crc_errors,
+		   p.bad_headers, p.skipped, p.hunted);
+	return errors != 0;
+}
+
+#endif
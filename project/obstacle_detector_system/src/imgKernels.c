@@ -0,0 +1,864 @@
+/* ************************************************************
+ * Image processing kernels, see imgKernels.h
+ * This file is shared by the host tools and the Zephyr app
+ * (src/imgKernels.c is a copy).
+ ************************************************************** */
+
+#include <stdint.h>
+#include <string.h>
+#include "imgKernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86
+#include <immintrin.h>
+#endif
+
+/* One pixel at a time */
+static void rowMaskScalar(const uint8_t *row, uint8_t color, uint64_t mask[ROW_WORDS])
+{
+	for (int w = 0; w < ROW_WORDS; w++)
+	{
+		uint64_t m = 0;
+		for (int i = 0; i < 64; i++)
+			m |= (uint64_t)(row[w * 64 + i] == color) << i;
+		mask[w] = m;
+	}
+}
+
+/* 4 pixels per 32-bit word: a byte of x is zero where the pixel has the
+ * color, its high bit is gathered into a nibble by one multiply */
+static void rowMaskSwar(const uint8_t *row, uint8_t color, uint64_t mask[ROW_WORDS])
+{
+	uint32_t pattern = color * 0x01010101u;
+	for (int w = 0; w < ROW_WORDS; w++)
+	{
+		uint64_t m = 0;
+		for (int i = 0; i < 64; i += 4)
+		{
+			uint32_t x;
+			memcpy(&x, row + w * 64 + i, 4); /* little endian */
+			x ^= pattern;
+			/* high bit of each byte set if the byte is not zero, exact */
+			uint32_t nz = (((x & 0x7F7F7F7Fu) + 0x7F7F7F7Fu) | x) & 0x80808080u;
+			uint32_t z = (~nz & 0x80808080u) >> 7;
+			m |= (uint64_t)((z * 0x10204080u) >> 28) << i;
+		}
+		mask[w] = m;
+	}
+}
+
+#ifdef KERNEL_X86
+/* 16 pixels per compare */
+static void rowMaskSse2(const uint8_t *row, uint8_t color, uint64_t mask[ROW_WORDS])
+{
+	__m128i c = _mm_set1_epi8((char)color);
+	for (int w = 0; w < ROW_WORDS; w++)
+	{
+		uint64_t m = 0;
+		for (int i = 0; i < 64; i += 16)
+		{
+			__m128i px = _mm_loadu_si128((const __m128i *)(row + w * 64 + i));
+			m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(px, c)) << i;
+		}
+		mask[w] = m;
+	}
+}
+
+/* 32 pixels per compare */
+__attribute__((target("avx2"))) static void rowMaskAvx2(const uint8_t *row, uint8_t color, uint64_t mask[ROW_WORDS])
+{
+	__m256i c = _mm256_set1_epi8((char)color);
+	for (int w = 0; w < ROW_WORDS; w++)
+	{
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(row + w * 64));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(row + w * 64 + 32));
+		uint32_t mlo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, c));
+		uint32_t mhi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, c));
+		mask[w] = (uint64_t)mhi << 32 | mlo;
+	}
+}
+#endif
+
+static void (*rowMask)(const uint8_t *, uint8_t, uint64_t *) = 0;
+static const char *rowMaskName = "";
+
+int kernelSelect(enum kernelImpl impl)
+{
+	if (impl == KERNEL_AUTO)
+	{
+#ifdef KERNEL_X86
+		if (kernelSelect(KERNEL_AVX2) == 0)
+			return 0;
+		return kernelSelect(KERNEL_SSE2);
+#else
+		return kernelSelect(KERNEL_SWAR);
+#endif
+	}
+
+	switch (impl)
+	{
+	case KERNEL_SCALAR:
+		rowMask = rowMaskScalar;
+		rowMaskName = "scalar";
+		return 0;
+	case KERNEL_SWAR:
+		rowMask = rowMaskSwar;
+		rowMaskName = "swar";
+		return 0;
+#ifdef KERNEL_X86
+	case KERNEL_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		rowMask = rowMaskSse2;
+		rowMaskName = "sse2";
+		return 0;
+	case KERNEL_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		rowMask = rowMaskAvx2;
+		rowMaskName = "avx2";
+		return 0;
+#endif
+	default:
+		return -1;
+	}
+}
+
+const char *kernelName(void)
+{
+	if (rowMask == 0)
+		kernelSelect(KERNEL_AUTO);
+	return rowMaskName;
+}
+
+void rowColorMask(const uint8_t *row, uint8_t color, uint64_t mask[ROW_WORDS])
+{
+	if (rowMask == 0)
+		kernelSelect(KERNEL_AUTO);
+	rowMask(row, color, mask);
+}
+
+int maskRuns(const uint64_t mask[ROW_WORDS])
+{
+	int runs = 0;
+	uint64_t carry = 0; /* last pair bit of the previous word */
+	for (int w = 0; w < ROW_WORDS; w++)
+	{
+		uint64_t next = w + 1 < ROW_WORDS ? mask[w + 1] : 0;
+		/* bit i set when pixels i and i+1 are both set: one run of pairs per run >= 2 */
+		uint64_t pairs = mask[w] & (mask[w] >> 1 | next << 63);
+		/* count where each run of pairs starts */
+		runs += __builtin_popcountll(pairs & ~(pairs << 1 | carry));
+		carry = pairs >> 63;
+	}
+	return runs;
+}
+
+int maskFirst(const uint64_t mask[ROW_WORDS])
+{
+	for (int w = 0; w < ROW_WORDS; w++)
+		if (mask[w] != 0)
+			return w * 64 + __builtin_ctzll(mask[w]);
+	return -1;
+}
+
+void colsMask(int x0, int x1, uint64_t mask[ROW_WORDS])
+{
+	for (int w = 0; w < ROW_WORDS; w++)
+	{
+		int lo = x0 - w * 64, hi = x1 - w * 64;
+		lo = lo < 0 ? 0 : lo;
+		hi = hi > 64 ? 64 : hi;
+		if (lo >= hi)
+			mask[w] = 0;
+		else
+			mask[w] = (hi - lo == 64 ? ~(uint64_t)0 : (((uint64_t)1 << (hi - lo)) - 1)) << lo;
+	}
+}
+
+/* Columns NOB_COL .. NOB_COL + NOB_WIDTH - 1 */
+static void nearWindow(uint64_t window[ROW_WORDS])
+{
+	colsMask(NOB_COL, NOB_COL + NOB_WIDTH, window);
+}
+
+/* Obstacle runs inside the near-obstacle window of a row mask */
+static int nearRuns(const uint64_t mask[ROW_WORDS], const uint64_t window[ROW_WORDS])
+{
+	uint64_t inside[ROW_WORDS];
+	for (int w = 0; w < ROW_WORDS; w++)
+		inside[w] = mask[w] & window[w];
+	return maskRuns(inside);
+}
+
+int obstCountRuns(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	uint64_t mask[ROW_WORDS];
+	int nobs = 0;
+
+	for (int j = 0; j < IMGWIDTH; j++)
+	{
+		rowColorMask(img[j], OBSTACLE_COLOR, mask);
+		nobs += maskRuns(mask);
+	}
+	return nobs;
+}
+
+int nearObstRuns(const uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	uint64_t mask[ROW_WORDS], window[ROW_WORDS];
+
+	nearWindow(window);
+	for (int j = NOB_ROW; j < IMGWIDTH; j++)
+	{
+		rowColorMask(img[j], OBSTACLE_COLOR, mask);
+		if (nearRuns(mask, window) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+int maskRunList(const uint64_t mask[ROW_WORDS], uint8_t start[], uint8_t end[])
+{
+	int n = 0, open = 0;
+	uint64_t prev = 0; /* last pixel of the previous word */
+	for (int w = 0; w < ROW_WORDS; w++)
+	{
+		/* bit set where a pixel differs from the one on its left */
+		uint64_t edges = mask[w] ^ (mask[w] << 1 | prev);
+		while (edges != 0)
+		{
+			int col = w * 64 + __builtin_ctzll(edges);
+			if (!open)
+				start[n] = col;
+			else
+				end[n++] = col - 1;
+			open = !open;
+			edges &= edges - 1;
+		}
+		prev = mask[w] >> 63;
+	}
+	if (open)
+		end[n++] = IMGWIDTH - 1;
+	return n;
+}
+
+static int labelFind(struct label_table *t, int l)
+{
+	while (t->parent[l] != l)
+	{
+		t->parent[l] = t->parent[t->parent[l]]; /* path halving */
+		l = t->parent[l];
+	}
+	return l;
+}
+
+/* the smaller label stays the root and takes the sums of the other one,
+   so a root always holds its whole component */
+static int labelUnion(struct label_table *t, int a, int b)
+{
+	a = labelFind(t, a);
+	b = labelFind(t, b);
+	if (a == b)
+		return a;
+	if (a > b)
+	{
+		int tmp = a;
+		a = b;
+		b = tmp;
+	}
+	t->parent[b] = a;
+	if (t->acc[b].x0 < t->acc[a].x0)
+		t->acc[a].x0 = t->acc[b].x0;
+	if (t->acc[b].x1 > t->acc[a].x1)
+		t->acc[a].x1 = t->acc[b].x1;
+	if (t->acc[b].y0 < t->acc[a].y0)
+		t->acc[a].y0 = t->acc[b].y0;
+	if (t->acc[b].y1 > t->acc[a].y1)
+		t->acc[a].y1 = t->acc[b].y1;
+	if (t->acc[b].first < t->acc[a].first)
+		t->acc[a].first = t->acc[b].first;
+	t->acc[a].area += t->acc[b].area;
+	t->acc[a].sx += t->acc[b].sx;
+	t->acc[a].sy += t->acc[b].sy;
+	return a;
+}
+
+/* Table full: frees the labels merged into another one and the single
+   pixels that ended before the previous row, which no run can reach any
+   more. Runs of the previous row and the first nrun of this one are
+   moved to their roots first */
+static void labelRecycle(struct label_table *t, int row, int cur, int nrun)
+{
+	int prv = cur ^ 1;
+	for (int q = 0; q < t->nruns[prv]; q++)
+		if (t->label[prv][q] != NO_LABEL)
+			t->label[prv][q] = labelFind(t, t->label[prv][q]);
+	for (int q = 0; q < nrun; q++)
+		if (t->label[cur][q] != NO_LABEL)
+			t->label[cur][q] = labelFind(t, t->label[cur][q]);
+	for (int l = 0; l < t->nlabels; l++)
+		if (t->parent[l] != NO_LABEL)
+			t->parent[l] = labelFind(t, l);
+	for (int l = 0; l < t->nlabels; l++)
+	{
+		if (t->parent[l] == NO_LABEL)
+			continue;
+		if (t->parent[l] != l || (t->acc[l].area < 2 && t->acc[l].y1 + 1 < row))
+		{
+			t->parent[l] = NO_LABEL;
+			t->free[t->nfree++] = l;
+		}
+	}
+}
+
+/* a new label, NO_LABEL if none is left */
+static int labelNew(struct label_table *t, int row, int cur, int nrun)
+{
+	if (t->nfree == 0 && t->nlabels == MAX_LABELS)
+		labelRecycle(t, row, cur, nrun);
+	if (t->nfree > 0)
+		return t->free[--t->nfree];
+	return t->nlabels < MAX_LABELS ? t->nlabels++ : NO_LABEL;
+}
+
+void labelBegin(struct label_table *t)
+{
+	t->nlabels = 0;
+	t->nfree = 0;
+	t->dropped = 0;
+	t->nruns[0] = t->nruns[1] = 0;
+}
+
+void labelRow(struct label_table *t, int row, const uint64_t mask[ROW_WORDS])
+{
+	int cur = row & 1, prv = cur ^ 1;
+	int n = maskRunList(mask, t->start[cur], t->end[cur]);
+	int p = 0;
+
+	t->nruns[cur] = n;
+	for (int r = 0; r < n; r++)
+	{
+		int s = t->start[cur][r], e = t->end[cur][r];
+		int l = NO_LABEL;
+
+		/* runs of the previous row touching this one, 8-connected */
+		while (p < t->nruns[prv] && t->end[prv][p] + 1 < s)
+			p++;
+		for (int q = p; q < t->nruns[prv] && t->start[prv][q] <= e + 1; q++)
+		{
+			int lq = t->label[prv][q];
+			if (lq == NO_LABEL)
+				continue;
+			l = l == NO_LABEL ? labelFind(t, lq) : labelUnion(t, l, lq);
+		}
+
+		if (l == NO_LABEL)
+		{
+			l = labelNew(t, row, cur, r);
+			if (l == NO_LABEL)
+			{
+				t->dropped++;
+				t->label[cur][r] = NO_LABEL;
+				continue;
+			}
+			t->parent[l] = l;
+			t->acc[l].x0 = s;
+			t->acc[l].x1 = e;
+			t->acc[l].y0 = row;
+			t->acc[l].first = row * IMGWIDTH + s;
+			t->acc[l].area = 0;
+			t->acc[l].sx = t->acc[l].sy = 0;
+		}
+		t->label[cur][r] = l;
+
+		/* the run is added to its root */
+		if (s < t->acc[l].x0)
+			t->acc[l].x0 = s;
+		if (e > t->acc[l].x1)
+			t->acc[l].x1 = e;
+		t->acc[l].y1 = row;
+		t->acc[l].area += e - s + 1;
+		t->acc[l].sx += (uint32_t)(s + e) * (e - s + 1) / 2;
+		t->acc[l].sy += (uint32_t)row * (e - s + 1);
+	}
+}
+
+int labelEnd(struct label_table *t, struct obstacle *obs, int max_obs)
+{
+	uint8_t root[MAX_LABELS];
+	int count = 0;
+
+	/* recycled labels come back out of order, sort by the first pixel */
+	for (int l = 0; l < t->nlabels; l++)
+	{
+		/* single pixels are noise, as for the run kernels */
+		if (t->parent[l] != l || t->acc[l].area < 2)
+			continue;
+		int i = count++;
+		for (; i > 0 && t->acc[root[i - 1]].first > t->acc[l].first; i--)
+			root[i] = root[i - 1];
+		root[i] = l;
+	}
+
+	for (int i = 0; i < count && i < max_obs; i++)
+	{
+		int l = root[i];
+		struct obstacle *o = &obs[i];
+		o->x0 = t->acc[l].x0;
+		o->y0 = t->acc[l].y0;
+		o->x1 = t->acc[l].x1;
+		o->y1 = t->acc[l].y1;
+		o->area = t->acc[l].area;
+		o->cx = (t->acc[l].sx + t->acc[l].area / 2) / t->acc[l].area;
+		o->cy = (t->acc[l].sy + t->acc[l].area / 2) / t->acc[l].area;
+	}
+	return count;
+}
+
+int labelObstacles(const uint8_t img[IMGWIDTH][IMGWIDTH], struct label_table *t, struct obstacle *obs, int max_obs)
+{
+	uint64_t mask[ROW_WORDS];
+
+	labelBegin(t);
+	for (int j = 0; j < IMGWIDTH; j++)
+	{
+		rowColorMask(img[j], OBSTACLE_COLOR, mask);
+		labelRow(t, j, mask);
+	}
+	return labelEnd(t, obs, max_obs);
+}
+
+void trackerInit(struct guide_tracker *t)
+{
+	memset(t, 0, sizeof(*t));
+	for (int b = 0; b < TRACK_BANDS; b++)
+		t->band[b] = -1;
+	trackBegin(t);
+}
+
+void trackBegin(struct guide_tracker *t)
+{
+	t->prev = -1;
+	t->prev_row = -1;
+}
+
+/* Guideline pixel nearest to col within TRACK_WINDOW, -1 if none */
+static int windowSearch(const uint8_t *row, int col)
+{
+	for (int d = 0; d <= TRACK_WINDOW; d++)
+	{
+		if (col - d >= 0 && row[col - d] == GUIDELINE_COLOR)
+			return col - d;
+		if (col + d < IMGWIDTH && row[col + d] == GUIDELINE_COLOR)
+			return col + d;
+	}
+	return -1;
+}
+
+int trackRow(struct guide_tracker *t, const uint8_t *row, int j)
+{
+	int b = j * TRACK_BANDS / IMGWIDTH;
+	int first = t->prev_row < 0 || t->prev_row * TRACK_BANDS / IMGWIDTH != b;
+	/* the previous row of this frame is closer than last frame's band */
+	int seed = !first && t->prev >= 0 ? t->prev : t->band[b];
+	int x = -1;
+
+	if (seed >= 0)
+		x = windowSearch(row, seed);
+	if (x >= 0)
+	{
+		while (x > 0 && row[x - 1] == GUIDELINE_COLOR)
+			x--;
+		t->tracked++;
+	}
+	else
+	{
+		/* lost (or never seen): full scan */
+		uint64_t mask[ROW_WORDS];
+		rowColorMask(row, GUIDELINE_COLOR, mask);
+		x = maskFirst(mask);
+		t->rescans++;
+		t->reacquired += x >= 0;
+	}
+
+	if (first)
+		t->band[b] = x;
+	t->prev = x;
+	t->prev_row = j;
+	return x;
+}
+
+void rowCacheInit(struct row_cache *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+uint64_t rowHash(const uint8_t *row)
+{
+	/* 4 independent lanes of multiply-xor over 64-bit words, so the
+	   multiplies overlap; mixed together at the end */
+	uint64_t h[4] = {0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull};
+	for (int i = 0; i < IMGWIDTH; i += 32)
+		for (int l = 0; l < 4; l++)
+		{
+			uint64_t w;
+			memcpy(&w, row + i + 8 * l, 8);
+			h[l] = (h[l] ^ w) * 0xFF51AFD7ED558CCDull;
+			h[l] ^= h[l] >> 32;
+		}
+	uint64_t x = h[0] ^ (h[1] << 16 | h[1] >> 48) ^ (h[2] << 32 | h[2] >> 32) ^ (h[3] << 48 | h[3] >> 16);
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x != 0 ? x : 1;
+}
+
+/* Results of one row, the guideline tracked when trk is given */
+static void rowAnalyze(const uint8_t *row, int j, const uint64_t window[ROW_WORDS], struct guide_tracker *trk,
+					   struct row_entry *e)
+{
+	uint64_t guide[ROW_WORDS];
+
+	/* both classifications run while the row is in cache */
+	rowColorMask(row, OBSTACLE_COLOR, e->obst);
+	if (trk != 0)
+		e->guide = trackRow(trk, row, j);
+	else
+	{
+		rowColorMask(row, GUIDELINE_COLOR, guide);
+		e->guide = maskFirst(guide);
+	}
+	e->runs = maskRuns(e->obst);
+	e->near = e->runs != 0 && nearRuns(e->obst, window) > 0;
+}
+
+void analyze_frame(const uint8_t img[IMGWIDTH][IMGWIDTH], struct frame_result *res, const struct frame_state *st)
+{
+	static const struct frame_state none;
+	uint64_t window[ROW_WORDS];
+	struct row_entry local;
+
+	if (st == 0)
+		st = &none;
+	struct label_table *t = st->labels;
+	struct row_cache *c = st->cache;
+	struct guide_tracker *trk = c != 0 ? 0 : st->tracker;
+
+	nearWindow(window);
+	res->obstacles = 0;
+	res->near_obstacle = 0;
+	res->objects = 0;
+	res->dropped = 0;
+	if (t != 0)
+		labelBegin(t);
+	if (trk != 0)
+		trackBegin(trk);
+	for (int j = 0; j < IMGWIDTH; j++)
+	{
+		struct row_entry *e = &local;
+		if (c != 0)
+		{
+			uint64_t h = rowHash(img[j]);
+			e = &c->entry[h & (ROW_CACHE_SIZE - 1)];
+			c->lookups++;
+			if (e->hash == h)
+				c->hits++;
+			else
+			{
+				rowAnalyze(img[j], j, window, 0, e);
+				e->hash = h;
+			}
+		}
+		else
+			rowAnalyze(img[j], j, window, trk, e);
+
+		res->guide[j] = e->guide;
+		res->runs[j] = e->runs;
+		res->obstacles += e->runs;
+		if (j >= NOB_ROW && e->near)
+			res->near_obstacle = 1;
+		if (t != 0)
+			labelRow(t, j, e->obst);
+	}
+	if (t != 0)
+	{
+		int n = labelEnd(t, res->obstacle, FRAME_MAX_OBSTACLES);
+		res->objects = n > 255 ? 255 : n;
+		res->dropped = t->dropped > 255 ? 255 : t->dropped;
+	}
+}
+
+void lineSumsInit(struct line_sums *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+void lineSumsAdd(struct line_sums *s, int y, int x)
+{
+	s->n++;
+	s->sy += y;
+	s->sx += x;
+	s->syy += y * y;
+	s->sxy += x * y;
+	s->sxx += x * x;
+}
+
+/* Integer square root */
+static uint32_t isqrt(uint64_t v)
+{
+	uint64_t r = 0, bit = (uint64_t)1 << 62;
+	while (bit > v)
+		bit >>= 2;
+	while (bit != 0)
+	{
+		if (v >= r + bit)
+		{
+			v -= r + bit;
+			r = (r >> 1) + bit;
+		}
+		else
+			r >>= 1;
+		bit >>= 2;
+	}
+	return r;
+}
+
+/* Rounded num / den, den > 0 */
+static int64_t divRound(int64_t num, int64_t den)
+{
+	return (num + (num >= 0 ? den / 2 : -den / 2)) / den;
+}
+
+int lineSumsFit(const struct line_sums *s, int near_row, int far_row, struct guide_fit *fit)
+{
+	/* centered sums times n, exact in 64 bits */
+	int64_t dyy = (int64_t)s->n * s->syy - (int64_t)s->sy * s->sy;
+	int64_t dxy = (int64_t)s->n * s->sxy - (int64_t)s->sx * s->sy;
+	int64_t dxx = (int64_t)s->n * s->sxx - (int64_t)s->sx * s->sx;
+
+	fit->rows = s->n > 255 ? 255 : s->n;
+	if (s->n < 2 || dyy == 0)
+		return -1;
+
+	/* slope b = dxy / dyy, column at a row = (sx + b * (n * row - sy)) / n */
+	fit->slope = divRound(dxy * 65536, dyy);
+	fit->pos = divRound((int64_t)s->sx * dyy + dxy * ((int64_t)s->n * near_row - s->sy), (int64_t)s->n * dyy);
+	fit->far = divRound((int64_t)s->sx * dyy + dxy * ((int64_t)s->n * far_row - s->sy), (int64_t)s->n * dyy);
+
+	/* sum of squared residuals = (dxx - dxy^2 / dyy) / n */
+	int64_t ssr = dxx - (dxy * dxy) / dyy;
+	if (ssr < 0)
+		ssr = 0;
+	fit->residual = isqrt(((uint64_t)ssr << 16) / ((uint64_t)s->n * s->n));
+	return 0;
+}
+
+int guideFit(const int16_t guide[IMGWIDTH], int step, int near_row, int far_row, struct guide_fit *fit)
+{
+	struct line_sums s;
+
+	lineSumsInit(&s);
+	for (int j = 0; j < IMGWIDTH; j += step)
+		if (guide[j] >= 0)
+			lineSumsAdd(&s, j, guide[j]);
+	fit->near_px = guide[near_row];
+	fit->far_px = guide[far_row];
+	return lineSumsFit(&s, near_row, far_row, fit);
+}
+
+int guideFitImage(const uint8_t img[IMGWIDTH][IMGWIDTH], int step, int near_row, int far_row, struct guide_fit *fit)
+{
+	uint64_t mask[ROW_WORDS];
+	struct line_sums s;
+
+	lineSumsInit(&s);
+	for (int j = 0; j < IMGWIDTH; j += step)
+	{
+		rowColorMask(img[j], GUIDELINE_COLOR, mask);
+		int x = maskFirst(mask);
+		if (x >= 0)
+			lineSumsAdd(&s, j, x);
+	}
+	rowColorMask(img[near_row], GUIDELINE_COLOR, mask);
+	fit->near_px = maskFirst(mask);
+	rowColorMask(img[far_row], GUIDELINE_COLOR, mask);
+	fit->far_px = maskFirst(mask);
+	return lineSumsFit(&s, near_row, far_row, fit);
+}
+
+int guidePos(const struct guide_fit *fit)
+{
+	return fit->near_px >= 0 ? fit->near_px : fit->pos;
+}
+
+int16_t guideAngle(const struct guide_fit *fit, int near_row, int far_row)
+{
+	int rows = far_row > near_row ? far_row - near_row : near_row - far_row;
+	if (fit->residual > GUIDE_MAX_RESIDUAL && fit->near_px >= 0 && fit->far_px >= 0)
+		return atanQ15(fit->far_px - fit->near_px, rows);
+	return atanQ15(fit->far - fit->pos, rows);
+}
+
+/* atan(i / 128) in Q15 fractions of pi, i = 0..128 */
+static const int16_t atanLut[129] = {
+	0, 81, 163, 244, 326, 407, 489, 570, 651, 732, 813, 894,
+	975, 1056, 1136, 1217, 1297, 1377, 1457, 1537, 1617, 1696, 1775, 1854,
+	1933, 2012, 2090, 2168, 2246, 2324, 2401, 2478, 2555, 2632, 2708, 2784,
+	2860, 2935, 3010, 3085, 3159, 3233, 3307, 3380, 3453, 3526, 3599, 3670,
+	3742, 3813, 3884, 3955, 4025, 4095, 4164, 4233, 4302, 4370, 4438, 4505,
+	4572, 4639, 4705, 4771, 4836, 4901, 4966, 5030, 5094, 5157, 5220, 5282,
+	5344, 5406, 5467, 5528, 5589, 5649, 5708, 5768, 5826, 5885, 5943, 6000,
+	6058, 6114, 6171, 6227, 6282, 6337, 6392, 6446, 6500, 6554, 6607, 6660,
+	6712, 6764, 6815, 6867, 6917, 6968, 7018, 7068, 7117, 7166, 7214, 7262,
+	7310, 7358, 7405, 7451, 7498, 7544, 7589, 7635, 7679, 7724, 7768, 7812,
+	7856, 7899, 7942, 7984, 8026, 8068, 8110, 8151, 8192,
+};
+
+int16_t atanQ15(int32_t dx, int32_t dy)
+{
+	uint32_t ax = dx < 0 ? -dx : dx;
+	int32_t a;
+
+	if (ax == 0)
+		return 0;
+	if (ax <= (uint32_t)dy)
+	{
+		/* ratio in Q15: table index and 8 bits to interpolate */
+		uint32_t t = ((uint64_t)ax << 15) / dy;
+		int i = t >> 8, frac = t & 0xFF;
+		a = i == 128 ? atanLut[128] : atanLut[i] + (((atanLut[i + 1] - atanLut[i]) * frac + 128) >> 8);
+	}
+	else
+		a = ANGLE_PI / 2 - atanQ15(dy, ax); /* atan(x) = pi/2 - atan(1/x) */
+	return dx < 0 ? -a : a;
+}
+
+void frameMasks(const uint8_t img[IMGWIDTH][IMGWIDTH], struct frame_masks *fm)
+{
+	for (int j = 0; j < IMGWIDTH; j++)
+	{
+		rowColorMask(img[j], OBSTACLE_COLOR, fm->obst[j]);
+		rowColorMask(img[j], GUIDELINE_COLOR, fm->guide[j]);
+	}
+}
+
+int bitmapCount(const uint64_t bm[IMGWIDTH][ROW_WORDS], int x0, int y0, int x1, int y1)
+{
+	uint64_t cols[ROW_WORDS];
+	int n = 0;
+
+	colsMask(x0, x1, cols);
+	for (int j = y0; j < y1; j++)
+		for (int w = 0; w < ROW_WORDS; w++)
+			n += __builtin_popcountll(bm[j][w] & cols[w]);
+	return n;
+}
+
+int bitmapObstCount(const struct frame_masks *fm)
+{
+	int nobs = 0;
+	for (int j = 0; j < IMGWIDTH; j++)
+		nobs += maskRuns(fm->obst[j]);
+	return nobs;
+}
+
+int bitmapNearObst(const struct frame_masks *fm)
+{
+	uint64_t window[ROW_WORDS];
+
+	nearWindow(window);
+	for (int j = NOB_ROW; j < IMGWIDTH; j++)
+	{
+		/* two adjacent obstacle pixels inside the window: m & (m >> 1) */
+		uint64_t any = 0;
+		for (int w = 0; w < ROW_WORDS; w++)
+		{
+			uint64_t m = fm->obst[j][w] & window[w];
+			uint64_t next = w + 1 < ROW_WORDS ? fm->obst[j][w + 1] & window[w + 1] : 0;
+			any |= m & (m >> 1 | next << 63);
+		}
+		if (any != 0)
+			return 1;
+	}
+	return 0;
+}
+
+int rleEncode(const uint8_t img[IMGWIDTH][IMGWIDTH], struct rle_frame *f)
+{
+	uint64_t bg[ROW_WORDS], fg[ROW_WORDS];
+	uint8_t start[IMGWIDTH / 2], end[IMGWIDTH / 2];
+	int n = 0;
+
+	for (int j = 0; j < IMGWIDTH; j++)
+	{
+		f->row[j] = n;
+		/* the vectorized classifier finds the pixels that are not
+		   background, only those spans are walked byte by byte */
+		rowColorMask(img[j], BACKGROUND_COLOR, bg);
+		for (int w = 0; w < ROW_WORDS; w++)
+			fg[w] = ~bg[w];
+		int spans = maskRunList(fg, start, end);
+		for (int k = 0; k < spans; k++)
+		{
+			int i = start[k];
+			while (i <= end[k])
+			{
+				int c = img[j][i], s = i;
+				while (++i <= end[k] && img[j][i] == c)
+					;
+				if (n == RLE_MAX_RUNS)
+					return -1;
+				f->run[n].start = s;
+				f->run[n].len = i - s;
+				f->run[n].color = c;
+				n++;
+			}
+		}
+	}
+	f->row[IMGWIDTH] = n;
+	return n;
+}
+
+void rleDecode(const struct rle_frame *f, uint8_t img[IMGWIDTH][IMGWIDTH])
+{
+	memset(img, BACKGROUND_COLOR, IMGWIDTH * IMGWIDTH);
+	for (int j = 0; j < IMGWIDTH; j++)
+		for (int r = f->row[j]; r < f->row[j + 1]; r++)
+			memset(&img[j][f->run[r].start], f->run[r].color, f->run[r].len);
+}
+
+int rleGuideFirst(const struct rle_frame *f, int row)
+{
+	for (int r = f->row[row]; r < f->row[row + 1]; r++)
+		if (f->run[r].color == GUIDELINE_COLOR)
+			return f->run[r].start;
+	return -1;
+}
+
+/* Runs of one color are maximal, so a run is what maskRuns counts */
+int rleObstCount(const struct rle_frame *f)
+{
+	int nobs = 0;
+	for (int r = 0; r < RLE_RUNS(f); r++)
+		nobs += f->run[r].color == OBSTACLE_COLOR && f->run[r].len > 1;
+	return nobs;
+}
+
+int rleNearObst(const struct rle_frame *f)
+{
+	for (int r = f->row[NOB_ROW]; r < RLE_RUNS(f); r++)
+	{
+		if (f->run[r].color != OBSTACLE_COLOR)
+			continue;
+		/* part of the run inside the window */
+		int s = f->run[r].start, e = s + f->run[r].len;
+		if (s < NOB_COL)
+			s = NOB_COL;
+		if (e > NOB_COL + NOB_WIDTH)
+			e = NOB_COL + NOB_WIDTH;
+		if (e - s > 1)
+			return 1;
+	}
+	return 0;
+}
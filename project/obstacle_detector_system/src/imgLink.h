@@ -0,0 +1,168 @@
+/* ************************************************************
+ * Framed image transport over the serial link, shared by
+ * serialTest.c and the obstacle detector (src/imgLink.h is a copy).
+ *
+ * A frame is a header, the payload and a CRC-32 of both:
+ *   sync    4 bytes  A5 5A C3 3C
+ *   width   2        \
+ *   height  2         |
+ *   seq     2         | little endian
+ *   flags   2         |
+ *   len     4        /  payload bytes
+ *   hcrc    2        low 16 bits of the CRC-32 of the 16 bytes above
+ *   payload len
+ *   crc     4        CRC-32 of header and payload
+ * The header check rejects a sync word found inside a payload at
+ * once, and after a bad CRC the parser hunts again from the byte
+ * after the failed sync word, so a corrupted or cut frame costs
+ * that frame only.
+ *
+ * Images are mostly runs of background with short guideline and
+ * obstacle segments, so they are usually sent packed (LINK_RLE), or as
+ * the change from the previous frame (LINK_DELTA). A receiver that missed
+ * frame seq - 1 skips deltas until the next LINK_RLE or LINK_RAW frame.
+ ************************************************************** */
+
+#ifndef IMG_LINK_H
+#define IMG_LINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LINK_HDR_SIZE 18
+#define LINK_CRC_SIZE 4
+#define LINK_OVERHEAD (LINK_HDR_SIZE + LINK_CRC_SIZE)
+
+/* flags */
+#define LINK_RAW 0x0000   /* payload is the image, row after row */
+#define LINK_RLE 0x0001   /* payload is the image packed by linkPack */
+#define LINK_DELTA 0x0002 /* payload is the XOR of the image with the one of
+                             frame seq - 1, packed by linkPack */
+
+#define LINK_CTRL 0x0100  /* payload is a link_ctrl message, width and
+                             height 0, seq 0 */
+
+/* Packed payloads longer than this are sent raw */
+#define LINK_PACKED_MAX 4096
+
+struct link_hdr
+{
+	uint16_t width, height;
+	uint16_t seq;
+	uint16_t flags;
+	uint32_t len; /* payload bytes */
+};
+
+/* CRC-32 (IEEE, as zlib), chained: crc = linkCrc32(crc, p, n), start with 0 */
+uint32_t linkCrc32(uint32_t crc, const uint8_t *p, size_t n);
+
+/* Writes the header, returns LINK_HDR_SIZE */
+size_t linkHeader(uint8_t out[LINK_HDR_SIZE], const struct link_hdr *h);
+
+/* Writes a whole frame, out has room for h->len + LINK_OVERHEAD bytes.
+ * Returns its size */
+size_t linkFrame(uint8_t *out, const struct link_hdr *h, const uint8_t *payload);
+
+/* Link rate negotiation. Both ends start at the base rate, without flow
+ * control, and the host asks for faster ones:
+ *   LINK_SET_RATE  host, at the current rate: switch to baud/flow
+ *   LINK_RATE_OK   target, at the current rate, then it switches
+ *                  (baud 0: not supported)
+ *   LINK_CONFIRM   host, then target, at the new rate. A rate not
+ *                  confirmed within LINK_CONFIRM_MS is given up: the host
+ *                  goes back at once, the target within 2 * LINK_CONFIRM_MS
+ *   LINK_FALLBACK  target, on repeated CRC errors: it goes back to the
+ *                  base rate after this
+ *   LINK_REPORT    host asks, target answers with the image frames that
+ *                  arrived, the frames it skipped and the CRC errors since
+ *                  the rate was confirmed (benchmarks)
+ * Away from the base rate either end may be left behind, a LINK_FALLBACK
+ * can be lost too: the host asks for a LINK_REPORT every LINK_ALIVE_MS
+ * and goes back to the base rate when none comes within LINK_CONFIRM_MS,
+ * the target goes back when it got no valid frame for LINK_IDLE_MS */
+#define LINK_BASE_BAUD 115200
+#define LINK_CONFIRM_MS 500
+#define LINK_ALIVE_MS 1000
+#define LINK_IDLE_MS 2000
+#define LINK_FLOW_RTS_CTS 1
+
+enum
+{
+	LINK_SET_RATE = 1,
+	LINK_RATE_OK,
+	LINK_CONFIRM,
+	LINK_FALLBACK,
+	LINK_REPORT,
+};
+
+/* Rates the protocol knows, slowest first. A target refuses the ones its
+ * UART cannot run (LINK_RATE_OK with baud 0) and the host stays below */
+#define LINK_NRATES 6
+extern const uint32_t linkRates[LINK_NRATES];
+
+struct link_ctrl
+{
+	uint8_t type;
+	uint8_t flow; /* LINK_FLOW_RTS_CTS or 0 */
+	uint32_t baud;
+	uint32_t frames; /* LINK_REPORT: image frames with a good CRC */
+	uint32_t crc_errors;
+	uint32_t skipped; /* LINK_REPORT: frames the target had no buffer for */
+};
+#define LINK_CTRL_SIZE 20
+
+/* Writes a LINK_CTRL frame, returns its size */
+size_t linkCtrlFrame(uint8_t out[LINK_CTRL_SIZE + LINK_OVERHEAD], const struct link_ctrl *c);
+
+/* Reads the payload of a LINK_CTRL frame, returns 0, -1 if it is not one */
+int linkCtrlRead(struct link_ctrl *c, const struct link_hdr *h, const uint8_t *payload);
+
+/* Run-length packing, row by row: a token byte is a run of 1 to 64
+ * pixels (low 6 bits + 1) of 0x00, 0x80, 0xFF (top bits 0, 1, 2) or of
+ * the value in the next byte (top bits 3). Runs do not cross rows */
+
+/* Packs the image, or its XOR with ref if ref is not NULL. Returns the
+ * packed size, 0 if more than max */
+size_t linkPack(uint8_t *out, size_t max, const uint8_t *img, const uint8_t *ref, int width, int height);
+
+/* Unpacks into img, XOR with ref if not NULL (img and ref are different
+ * buffers). Returns 0, -1 if the data is not exactly width x height pixels */
+int linkUnpack(uint8_t *img, const uint8_t *ref, const uint8_t *in, size_t len, int width, int height);
+
+/* Streaming parser, fed with whatever chunks the link delivers */
+struct link_parser
+{
+	/* Buffer for the payload of a valid header, at least h->len bytes,
+	 * or NULL to skip the frame */
+	uint8_t *(*buffer)(void *ctx, const struct link_hdr *h);
+	/* End of a frame that got a buffer: ok is 1 if the CRC matched. The
+	 * buffer is not used by the parser after this */
+	void (*done)(void *ctx, uint8_t *buf, const struct link_hdr *h, int ok);
+	void *ctx;
+	uint32_t max_len; /* longer payloads are bad headers */
+
+	/* state */
+	int state;
+	uint32_t have; /* bytes of the current part */
+	uint32_t crc;
+	struct link_hdr hdr;
+	uint8_t *buf;
+	uint8_t head[LINK_HDR_SIZE];
+	uint8_t tail[LINK_CRC_SIZE];
+	int replaying;
+
+	/* counters */
+	uint32_t frames;      /* with a good CRC, skipped ones too */
+	uint32_t ctrl_frames; /* LINK_CTRL ones among frames */
+	uint32_t crc_errors;
+	uint32_t bad_headers; /* sync word without a valid header */
+	uint32_t skipped;     /* frames with a good header but no buffer */
+	uint32_t hunted;      /* bytes thrown away looking for a sync word */
+};
+
+void linkInit(struct link_parser *p, uint32_t max_len, uint8_t *(*buffer)(void *, const struct link_hdr *),
+			  void (*done)(void *, uint8_t *, const struct link_hdr *, int), void *ctx);
+
+void linkParse(struct link_parser *p, const uint8_t *data, size_t n);
+
+#endif
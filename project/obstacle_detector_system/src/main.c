@@ -12,8 +12,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <math.h>
 #include "cab.h"
+#include "imgKernels.h"
+#include "imgLink.h"
 
 // Image constants
 #define IMGWIDTH 128             /* Square image. Side size, in pixels*/
@@ -22,10 +23,14 @@
 #define OBSTACLE_COLOR 0x80      /* Obstacle color */
 #define GN_ROW 0                 /* Row to look for the guiode line - close */
 #define GF_ROW (IMGWIDTH - 1)    /* Row to look for the guiode line - far */
+#define GUIDE_STEP 2             /* Rows between the ones fitted to the guideline */
 #define NOB_ROW (IMGWIDTH / 2)   /* Row to look for near obstacles */
 #define NOB_COL (IMGWIDTH / 4)   /* Col to look for near obstacles */
 #define NOB_WIDTH (IMGWIDTH / 2) /* WIDTH of the sensor area */
 
+/* Row-major view of an image inside a CAB buffer: image[row][col], no copy */
+#define IMAGE_VIEW(mes) ((const uint8_t(*)[IMGWIDTH])(mes))
+
 uint8_t vertical_guide_image_data[IMGWIDTH][IMGWIDTH] =
     {
         {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
@@ -293,23 +298,21 @@ uint8_t left_45_guide_image_data[IMGWIDTH][IMGWIDTH] =
 #define SAMP_PERIOD_MS 1000
 
 /* Semaphores for task sync */
-struct k_sem sem_rcvimg;
-struct k_sem sem_rcvimg_nearobs;
-struct k_sem sem_rcvimg_orientation;
-struct k_sem sem_rcvimg_obscount;
+/* (analysis waits for new images on image_cab and the other tasks for its
+   results on result_cab, see get_mes_newer) */
+struct k_sem sem_rcvimg; /* reception stopped, or a link control message arrived */
+struct k_sem sem_tx;     /* control message sent */
 struct k_sem sem_tasks_output;
 
-/* irq keys*/
-unsigned int key1;
-unsigned int key2;
-unsigned int key3;
-
 /* Global vars (shared memory between tasks) */
 uint8_t nearobs_output = 0;                              // Yes(1) or No(0)
-char orientation_output[2][10] = {{"000"}, {"000.000"}}; // position and angle
+int16_t orientation_pos = -1;                            // guideline position, -1 if not found
+int16_t orientation_angle = 0;                           // guideline angle, Q15 fraction of pi (atanQ15)
 uint16_t obscount_output = 0;                            // obstacle count
+uint8_t obscount_dropped = 0;                            // obstacle runs the labeller had no label for
 
 /* Thread scheduling priority */
+#define thread_analysis_prio 0 // ahead of the tasks reading its results
 #define thread_receive_image_prio 5 // it may not be the highest... Temos que ver istooooooooooooooooooooooooooooo
 #define thread_near_obstacle_prio 4
 #define thread_output_prio 3
@@ -318,6 +321,7 @@ uint16_t obscount_output = 0;                            // obstacle count
 
 /* Create thread stack space */
 K_THREAD_STACK_DEFINE(thread_receive_image_stack, STACK_SIZE);
+K_THREAD_STACK_DEFINE(thread_analysis_stack, STACK_SIZE);
 K_THREAD_STACK_DEFINE(thread_near_obstacle_stack, STACK_SIZE);
 K_THREAD_STACK_DEFINE(thread_orientation_stack, STACK_SIZE);
 K_THREAD_STACK_DEFINE(thread_output_stack, STACK_SIZE);
@@ -325,6 +329,7 @@ K_THREAD_STACK_DEFINE(thread_obscount_stack, STACK_SIZE);
 
 /* Create variables for thread data */
 struct k_thread thread_receive_image_data;
+struct k_thread thread_analysis_data;
 struct k_thread thread_near_obstacle_data;
 struct k_thread thread_orientation_data;
 struct k_thread thread_output_data;
@@ -332,37 +337,240 @@ struct k_thread thread_obscount_data;
 
 /* Create task IDs */
 k_tid_t thread_receive_image_tid;
+k_tid_t thread_analysis_tid;
 k_tid_t thread_near_obstacle_tid;
 k_tid_t thread_orientation_tid;
 k_tid_t thread_output_tid;
 k_tid_t thread_obscount_tid;
 
-/* Cab */
-cab *image_cab;
-
-uint8_t **castImage(uint8_t *img);
+/* Cabs, statically allocated: readers + 1 being filled + 1 most recent */
+/* Images are read only by the analysis task, the UART fills one buffer
+   and holds the next one armed */
+#define IMAGE_CAB_NUM 4
+CAB_DEFINE(image_cab, IMAGE_CAB_NUM, IMGWIDTH * IMGWIDTH);
+/* Analysis results of each image, read by near_obstacle, orientation and obscount */
+#define RESULT_CAB_NUM 5
+CAB_DEFINE(result_cab, RESULT_CAB_NUM, sizeof(struct frame_result));
+/* Labeller state of the analysis task, too big for its stack */
+struct label_table labels;
+/* Guideline tracked from image to image by the analysis task */
+struct guide_tracker tracker;
+/* Or rows memoized from image to image (the tracker is then not used),
+   pays off when images repeat whole rows as the generated ones do and
+   rows are classified by the SWAR kernel; off until measured here */
+// #define ANALYSIS_ROW_CACHE
+#ifdef ANALYSIS_ROW_CACHE
+struct row_cache row_cache;
+struct frame_state analysis_state = {.labels = &labels, .cache = &row_cache};
+#else
+struct frame_state analysis_state = {.labels = &labels, .tracker = &tracker};
+#endif
 
 // //UART
 #define FATAL_ERR -1 /* Fatal error return code, app terminates */
 
 #define UART_NODE DT_NODELABEL(uart0) /* UART Node label, see dts */
 
-#define RXBUF_SIZE IMGWIDTH *IMGWIDTH /* RX buffer size */
-#define RX_TIMEOUT 1000               /* Inactivity period after the instant when last char was received that triggers an rx event (in us) */
-
-/* Struct for UART configuration (if using default values is not needed) */
-const struct uart_config uart_cfg = {
-    .baudrate = 115200,
+#define RXBUF_SIZE IMGWIDTH *IMGWIDTH /* Image payload size */
+#define RX_CHUNK 256                  /* DMA chunk, handed to the frame parser */
+#define RX_TIMEOUT 1000               /* Inactivity timeout (us): a partly filled chunk is parsed when the link goes quiet */
+#define LINK_CHECK_MS 100             /* Period of the link checks of the receive task */
+#define LINK_FALLBACK_ERRORS 3        /* CRC errors within a second that send the link back to the base rate */
+#define LINK_MAX_BAUD 1000000         /* Fastest rate the UARTE driver configures, faster linkRates are refused */
+
+/* Struct for UART configuration, rate and flow control set at run time
+   by the host (see LINK_SET_RATE in imgLink.h) */
+struct uart_config uart_cfg = {
+    .baudrate = LINK_BASE_BAUD,
     .parity = UART_CFG_PARITY_NONE,
     .stop_bits = UART_CFG_STOP_BITS_1,
     .data_bits = UART_CFG_DATA_BITS_8,
     .flow_ctrl = UART_CFG_FLOW_CTRL_NONE};
 
 /* UAR related variables */
-const struct device *uart_dev;       /* Pointer to device struct */
-static uint8_t rx_buf[RXBUF_SIZE];   /* RX buffer, to store received data */
-static uint8_t rx_chars[RXBUF_SIZE]; /* chars actually received  */
-volatile int uart_rxbuf_nchar = 0;   /* Number of chars currnetly on the rx buffer */
+const struct device *uart_dev; /* Pointer to device struct */
+/* Images come in frames (imgLink.h). The DMA fills two chunks in turn and
+   the parser copies the payload of each frame into a reserved image_cab
+   buffer (or a packed one, unpacked by the receive task), so a lost or
+   corrupted byte costs one image, not the alignment of all the following
+   ones */
+static uint8_t rx_chunk[2][RX_CHUNK];
+static int rx_next; /* chunk given on the next buffer request */
+static struct link_parser rx_link;
+static uint8_t *rx_spare[IMAGE_CAB_NUM]; /* buffers of failed frames, reused */
+static int rx_nspare;
+/* Packed frames (LINK_RLE, LINK_DELTA) are received whole and checked
+   before they are unpacked into an image_cab buffer: a corrupted change
+   would spoil every image after it. Two, for the parser's resync */
+static uint8_t rx_packed[2][LINK_PACKED_MAX];
+static volatile int rx_packed_busy[2];
+/* Frames with a good CRC, published in order by the receive task: raw
+   images as they are, packed ones once unpacked, which takes too long
+   for uart_cb. Never full: it holds at most every image_cab buffer and
+   both packed ones */
+#define RX_QUEUE 8
+BUILD_ASSERT(IMAGE_CAB_NUM + 2 <= RX_QUEUE, "rx_queue too short");
+struct rx_frame
+{
+    uint8_t *buf;
+    struct link_hdr hdr;
+};
+static struct rx_frame rx_queue[RX_QUEUE];
+static volatile unsigned int rx_queue_head, rx_queue_tail; /* written by uart_cb, by the receive task */
+/* Last image queued, the one a change must follow (uart_cb) */
+static uint16_t rx_base_seq;
+static int rx_have_base;
+/* Last published image, held (get_mes) as the base of the next change
+   (receive task) */
+static uint8_t *rx_ref;
+static uint16_t rx_ref_seq;
+/* Link control message for the receive task */
+static uint8_t rx_ctrl_buf[LINK_CTRL_SIZE];
+static struct link_ctrl rx_ctrl;
+static volatile int rx_ctrl_pending;
+static volatile int rx_off = 1; /* reception disabled, the receive task enables it */
+
+/* Reception counters, written by uart_cb and the receive task (frame
+   counters in rx_link) */
+struct rx_counters
+{
+    uint32_t images;         /* published */
+    uint32_t images_dropped; /* no free buffer */
+    uint32_t packed;         /* published from packed frames */
+    uint32_t no_ref;         /* changes from an image not received */
+    uint32_t bad_packing;    /* packed frames with a good CRC that do not unpack */
+    uint32_t ctrl;           /* link control frames */
+    uint32_t overruns;       /* UART_RX_STOPPED: overrun */
+    uint32_t errors;         /* UART_RX_STOPPED: other reasons */
+    uint32_t events;         /* UART_RX_RDY events of the image being received */
+    uint32_t events_last;    /* and of the last one received */
+};
+volatile struct rx_counters rx_stats;
+
+/* Image buffers, shared by uart_cb and the receive task */
+/* A spare image_cab buffer or a newly reserved one, NULL if none */
+static uint8_t *rx_image(void)
+{
+    unsigned int key = irq_lock();
+    uint8_t *buf = rx_nspare > 0 ? rx_spare[--rx_nspare] : (uint8_t *)reserve(&image_cab);
+    if (buf == NULL)
+        rx_stats.images_dropped++; /* all buffers held by slow consumers */
+    irq_unlock(key);
+    return buf;
+}
+
+/* Keeps a reserved buffer that holds no image */
+static void rx_recycle(uint8_t *buf)
+{
+    unsigned int key = irq_lock();
+    rx_spare[rx_nspare++] = buf;
+    irq_unlock(key);
+}
+
+/* Frame parser callbacks, called from uart_cb */
+/* Buffer for the payload of a new frame: an image_cab buffer for a raw
+   image, a packed one otherwise, NULL to skip the frame */
+static uint8_t *rx_buffer(void *ctx, const struct link_hdr *h)
+{
+    if (h->flags == LINK_CTRL)
+        return h->len == LINK_CTRL_SIZE && !rx_ctrl_pending ? rx_ctrl_buf : NULL;
+    if (h->width != IMGWIDTH || h->height != IMGWIDTH)
+        return NULL;
+    rx_stats.events = 0;
+    if (h->flags == LINK_RAW)
+        return h->len == RXBUF_SIZE ? rx_image() : NULL;
+    if ((h->flags != LINK_RLE && h->flags != LINK_DELTA) || h->len > LINK_PACKED_MAX)
+        return NULL;
+    if (h->flags == LINK_DELTA && (!rx_have_base || h->seq != (uint16_t)(rx_base_seq + 1)))
+    {
+        rx_stats.no_ref++; /* wait for the next whole image */
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++)
+        if (!rx_packed_busy[i])
+        {
+            rx_packed_busy[i] = 1;
+            return rx_packed[i];
+        }
+    return NULL;
+}
+
+/* End of a frame: queued for the receive task if the CRC matched,
+   otherwise the buffer is kept for the next one */
+static void rx_done(void *ctx, uint8_t *buf, const struct link_hdr *h, int ok)
+{
+    if (h->flags == LINK_CTRL)
+    {
+        /* handled by the receive task, which may reconfigure the UART */
+        if (ok && linkCtrlRead(&rx_ctrl, h, buf) == 0)
+        {
+            rx_stats.ctrl++;
+            rx_ctrl_pending = 1;
+            k_sem_give(&sem_rcvimg);
+        }
+        return;
+    }
+    if (!ok)
+    {
+        if (h->flags == LINK_RAW)
+            rx_recycle(buf);
+        else
+            rx_packed_busy[buf == rx_packed[1]] = 0;
+        return;
+    }
+
+    struct rx_frame *f = &rx_queue[rx_queue_head % RX_QUEUE];
+    f->buf = buf;
+    f->hdr = *h;
+    rx_queue_head++;
+    rx_base_seq = h->seq;
+    rx_have_base = 1;
+    rx_stats.events_last = rx_stats.events;
+    k_sem_give(&sem_rcvimg);
+}
+
+/* Receive task: publishes an image (wakes the analysis) and holds it as
+   the next base */
+static void rx_publish(uint8_t *img, uint16_t seq)
+{
+    put_mes((void *)img, &image_cab);
+    if (rx_ref != NULL)
+        unget((void *)rx_ref, &image_cab);
+    rx_ref = (uint8_t *)get_mes(&image_cab);
+    rx_ref_seq = seq;
+    rx_stats.images++;
+}
+
+/* Receive task: publishes the queued frames, unpacking the packed ones */
+static void rx_unqueue(void)
+{
+    while (rx_queue_tail != rx_queue_head)
+    {
+        struct rx_frame *f = &rx_queue[rx_queue_tail % RX_QUEUE];
+        uint8_t *img = f->buf;
+        if (f->hdr.flags != LINK_RAW)
+        {
+            /* a change from an image that was not published is dropped */
+            int delta = f->hdr.flags == LINK_DELTA;
+            img = NULL;
+            if (delta && (rx_ref == NULL || f->hdr.seq != (uint16_t)(rx_ref_seq + 1)))
+                rx_stats.no_ref++;
+            else if ((img = rx_image()) != NULL &&
+                     linkUnpack(img, delta ? rx_ref : NULL, f->buf, f->hdr.len, IMGWIDTH, IMGWIDTH) != 0)
+            {
+                rx_stats.bad_packing++;
+                rx_recycle(img);
+                img = NULL;
+            }
+            rx_packed_busy[f->buf == rx_packed[1]] = 0;
+            if (img != NULL)
+                rx_stats.packed++;
+        }
+        if (img != NULL)
+            rx_publish(img, f->hdr.seq);
+        rx_queue_tail++;
+    }
+}
 
 /* UART callback function prototype */
 static void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data);
@@ -370,6 +578,7 @@ static void uart_cb(const struct device *dev, struct uart_event *evt, void *user
 /* Thread code prototypes */
 void thread_near_obstacle_code(void *argA, void *argB, void *argC);
 void thread_receive_image_code(void *argA, void *argB, void *argC);
+void thread_analysis_code(void *argA, void *argB, void *argC);
 void thread_orientation_code(void *argA, void *argB, void *argC);
 void thread_output_code(void *argA, void *argB, void *argC);
 void thread_obscount_code(void *argA, void *argB, void *argC);
@@ -406,14 +615,6 @@ void main(void)
         return;
     }
 
-    /* Enable data reception */
-    err = uart_rx_enable(uart_dev, rx_buf, sizeof(rx_buf), RX_TIMEOUT);
-    if (err)
-    {
-        printk("uart_rx_enable() error. Error code:%d\n\r", err);
-        return;
-    }
-
     /* Register callback */
     err = uart_callback_set(uart_dev, uart_cb, NULL);
     if (err)
@@ -422,24 +623,20 @@ void main(void)
         return;
     }
 
-    /* Initialize cab */
-
-    uint8_t **img1 = (uint8_t **)malloc(IMGWIDTH * sizeof(uint8_t *));
-    for (uint8_t j = 0; j < IMGWIDTH; j++)
-        img1[j] = (uint8_t *)malloc(IMGWIDTH * sizeof(uint8_t));
-
-    for (size_t i = 0; i < IMGWIDTH; i++)
-        for (size_t j = 0; j < IMGWIDTH; j++)
-            img1[i][j] = vertical_guide_image_data[i][j];
+    /* Initialize cabs, the first result is the one of the first image */
+    static struct frame_result first_result;
+    init_cab(&image_cab, (void *)vertical_guide_image_data);
+    trackerInit(&tracker);
+#ifdef ANALYSIS_ROW_CACHE
+    rowCacheInit(&row_cache);
+#endif
+    analyze_frame(IMAGE_VIEW(vertical_guide_image_data), &first_result, &analysis_state);
+    init_cab(&result_cab, (void *)&first_result);
 
-    printk("open cab");
-    image_cab = open_cab("image cab", 5, IMGWIDTH * IMGWIDTH, (void *)img1);
-
-    k_sem_init(&sem_rcvimg_nearobs, 0, 1);
-    k_sem_init(&sem_rcvimg_orientation, 0, 1);
     k_sem_init(&sem_tasks_output, 0, 1);
-    k_sem_init(&sem_rcvimg_obscount, 0, 1);
-    k_sem_init(&sem_rcvimg, 0, 1);
+    k_sem_init(&sem_rcvimg, 1, 1); /* the receive task enables reception */
+    k_sem_init(&sem_tx, 0, 1);
+    linkInit(&rx_link, RXBUF_SIZE, rx_buffer, rx_done, NULL);
 
     /* Create tasks */
     thread_near_obstacle_tid = k_thread_create(&thread_near_obstacle_data, thread_near_obstacle_stack,
@@ -448,6 +645,9 @@ void main(void)
     thread_receive_image_tid = k_thread_create(&thread_receive_image_data, thread_receive_image_stack,
                                                K_THREAD_STACK_SIZEOF(thread_receive_image_stack), thread_receive_image_code,
                                                NULL, NULL, NULL, thread_receive_image_prio, 0, K_NO_WAIT);
+    thread_analysis_tid = k_thread_create(&thread_analysis_data, thread_analysis_stack,
+                                          K_THREAD_STACK_SIZEOF(thread_analysis_stack), thread_analysis_code,
+                                          NULL, NULL, NULL, thread_analysis_prio, 0, K_NO_WAIT);
     thread_orientation_tid = k_thread_create(&thread_orientation_data, thread_orientation_stack,
                                              K_THREAD_STACK_SIZEOF(thread_orientation_stack), thread_orientation_code,
                                              NULL, NULL, NULL, thread_orientation_prio, 0, K_NO_WAIT);
@@ -461,79 +661,209 @@ void main(void)
     return;
 }
 
-/* Thread code implementations */
-
-void thread_receive_image_code(void *argA, void *argB, void *argC)
+/* Link rate, flow control and negotiation state, receive task only */
+static uint32_t link_prev_baud = LINK_BASE_BAUD; /* rate before an unconfirmed switch */
+static uint8_t link_prev_flow;
+static int64_t link_confirm_deadline; /* 0: the current rate is confirmed */
+static int link_reconfigure;          /* apply uart_cfg when reception is off */
+static uint32_t link_base_frames, link_base_crc, link_base_skipped; /* at the confirmation, for LINK_REPORT */
+static uint32_t link_window_crc;                 /* CRC errors at the start of the fallback window */
+static int64_t link_window_end;
+static uint32_t link_seen_frames;                /* rx_link.frames when link_seen was set */
+static int64_t link_seen;                        /* last time a valid frame arrived, or the rate changed */
+
+/* Sends a control message at the current rate and waits until it is out */
+static void link_send(uint8_t type, uint32_t baud, uint8_t flow, uint32_t frames, uint32_t crc_errors, uint32_t skipped)
 {
-    int64_t release_time = 0, start_time = 0, fin_time = 0, t_prev = 0, t_min = SAMP_PERIOD_MS, t_max = SAMP_PERIOD_MS;
-
-    printk("Thread receive_image init\n");
+    static uint8_t frame[LINK_CTRL_SIZE + LINK_OVERHEAD];
+    struct link_ctrl c = {.type = type, .flow = flow, .baud = baud, .frames = frames, .crc_errors = crc_errors,
+                          .skipped = skipped};
+    size_t n = linkCtrlFrame(frame, &c);
+    if (uart_tx(uart_dev, frame, n, SYS_FOREVER_US) == 0)
+        k_sem_take(&sem_tx, K_MSEC(100));
+}
 
-    /* Compute next release instant */
-    release_time = k_uptime_get() + SAMP_PERIOD_MS;
-    int i = 0;
+/* Switches to a new rate: reception is stopped and uart_cfg applied
+   before it is enabled again */
+static void link_switch(uint32_t baud, uint8_t flow)
+{
+    uart_cfg.baudrate = baud;
+    uart_cfg.flow_ctrl = flow ? UART_CFG_FLOW_CTRL_RTS_CTS : UART_CFG_FLOW_CTRL_NONE;
+    link_reconfigure = 1;
+    if (uart_rx_disable(uart_dev) != 0)
+        k_sem_give(&sem_rcvimg); /* already off */
+    link_window_crc = rx_link.crc_errors;
+    link_window_end = k_uptime_get() + 1000;
+    link_seen = k_uptime_get();
+}
 
-    /* Thread loop */
-    while (1)
+static void link_control(const struct link_ctrl *msg)
+{
+    /* image frames that made it over the link, whether or not there was a
+       buffer for them (those are skipped) */
+    uint32_t frames = rx_link.frames - rx_link.ctrl_frames;
+    switch (msg->type)
     {
-        // k_sem_take(&sem_rcvimg, K_FOREVER);
-        if (i < IMGWIDTH)
+    case LINK_SET_RATE:
+    {
+        int ok = 0;
+        for (int i = 0; i < LINK_NRATES; i++)
+            ok |= linkRates[i] == msg->baud && msg->baud <= LINK_MAX_BAUD;
+        if (!ok)
         {
+            link_send(LINK_RATE_OK, 0, 0, 0, 0, 0);
+            break;
+        }
+        link_send(LINK_RATE_OK, msg->baud, msg->flow, 0, 0, 0);
+        if (link_confirm_deadline == 0)
+        {
+            link_prev_baud = uart_cfg.baudrate;
+            link_prev_flow = uart_cfg.flow_ctrl != UART_CFG_FLOW_CTRL_NONE;
+        }
+        link_switch(msg->baud, msg->flow);
+        link_confirm_deadline = k_uptime_get() + 2 * LINK_CONFIRM_MS;
+        break;
+    }
+    case LINK_CONFIRM:
+        link_confirm_deadline = 0;
+        link_base_frames = frames;
+        link_base_crc = rx_link.crc_errors;
+        link_base_skipped = rx_link.skipped;
+        link_send(LINK_CONFIRM, uart_cfg.baudrate, uart_cfg.flow_ctrl != UART_CFG_FLOW_CTRL_NONE, 0, 0, 0);
+        printk("Link at %u baud%s\n\r", uart_cfg.baudrate,
+               uart_cfg.flow_ctrl != UART_CFG_FLOW_CTRL_NONE ? ", RTS/CTS" : "");
+        break;
+    case LINK_REPORT:
+        link_send(LINK_REPORT, uart_cfg.baudrate, uart_cfg.flow_ctrl != UART_CFG_FLOW_CTRL_NONE,
+                  frames - link_base_frames, rx_link.crc_errors - link_base_crc, rx_link.skipped - link_base_skipped);
+        break;
+    }
+}
 
-            start_time = k_uptime_get();
-            // printk("$Receive image -> %lld\n", (long long) start_time);
-
-            /* Code for receiving image */
-
-            uint8_t *img = (uint8_t *)reserve(image_cab);
-
-            // for(int i = 0; i < RXBUF_SIZE; i++){
-            //     img[i] = (uint8_t)rx_chars[i];
-            // }
-
-            // put_mes((void*)img, image_cab);
-            // k_sem_give(&sem_rcvimg_nearobs);
-            // k_sem_give(&sem_rcvimg_orientation);
-            // k_sem_give(&sem_rcvimg_obscount);
+/* Gives up a rate the host did not confirm, and falls back to the base
+   rate on repeated CRC errors or when no valid frame came for LINK_IDLE_MS
+   (the host lost the rate, or our LINK_FALLBACK) */
+static void link_check(void)
+{
+    int64_t now = k_uptime_get();
+    int fast = uart_cfg.baudrate != LINK_BASE_BAUD || uart_cfg.flow_ctrl != UART_CFG_FLOW_CTRL_NONE;
+    if (link_confirm_deadline != 0 && now > link_confirm_deadline)
+    {
+        printk("Link rate %u not confirmed, back to %u\n\r", uart_cfg.baudrate, link_prev_baud);
+        link_confirm_deadline = 0;
+        link_switch(link_prev_baud, link_prev_flow);
+        return;
+    }
+    if (rx_link.frames != link_seen_frames)
+    {
+        link_seen_frames = rx_link.frames;
+        link_seen = now;
+    }
+    if (link_confirm_deadline == 0 && fast && now - link_seen > LINK_IDLE_MS)
+    {
+        printk("Link: no frame for %d ms at %u baud, back to %u\n\r", (int)(now - link_seen), uart_cfg.baudrate,
+               LINK_BASE_BAUD);
+        link_send(LINK_FALLBACK, LINK_BASE_BAUD, 0, 0, 0, 0);
+        link_switch(LINK_BASE_BAUD, 0);
+        return;
+    }
+    if (now < link_window_end)
+        return;
+    if (link_confirm_deadline == 0 && rx_link.crc_errors - link_window_crc >= LINK_FALLBACK_ERRORS && fast)
+    {
+        printk("Link: %u CRC errors at %u baud, back to %u\n\r", rx_link.crc_errors - link_window_crc,
+               uart_cfg.baudrate, LINK_BASE_BAUD);
+        link_send(LINK_FALLBACK, LINK_BASE_BAUD, 0, 0, 0, 0);
+        link_switch(LINK_BASE_BAUD, 0);
+        return;
+    }
+    link_window_crc = rx_link.crc_errors;
+    link_window_end = now + 1000;
+}
 
-            left_45_guide_image_data[i][70] = OBSTACLE_COLOR;
-            left_45_guide_image_data[i][71] = OBSTACLE_COLOR;
+/* Thread code implementations */
 
-            memcpy(img, left_45_guide_image_data, IMGWIDTH * IMGWIDTH);
+void thread_receive_image_code(void *argA, void *argB, void *argC)
+{
+    printk("Thread receive_image init\n");
 
-            put_mes((void *)img, image_cab);
-            k_sem_give(&sem_rcvimg_nearobs);
-            k_sem_give(&sem_rcvimg_orientation);
-            k_sem_give(&sem_rcvimg_obscount);
-            i++;
+    /* Thread loop */
+    /* Images are received by the UART DMA into two chunks, chained by
+       uart_cb on every request, and queued by the frame parser; this task
+       publishes them, unpacking the packed ones. It also enables reception
+       at start and when the driver stopped it (errors, see UART_RX_STOPPED,
+       or a new rate), answers link control messages and watches the link.
+       The parser state is kept: a frame cut by a stop fails its CRC and the
+       parser resyncs on the next one */
+    while (1)
+    {
+        k_sem_take(&sem_rcvimg, K_MSEC(LINK_CHECK_MS));
 
-            fin_time = k_uptime_get();
+        rx_unqueue();
+        if (rx_ctrl_pending)
+        {
+            struct link_ctrl msg = rx_ctrl;
+            rx_ctrl_pending = 0;
+            link_control(&msg);
+        }
+        link_check();
 
-            // UPDATE WCET
-            // if (fin_time - start_time > WCET_rcvimage)
-            //     WCET_rcvimage = fin_time - start_time;
+        if (!rx_off)
+            continue;
+        if (link_reconfigure)
+        {
+            link_reconfigure = 0;
+            int err = uart_configure(uart_dev, &uart_cfg);
+            if (err)
+                printk("uart_configure() error. Error code:%d\n\r", err);
+        }
+        rx_next = 1;
+        rx_off = 0;
+        int err = uart_rx_enable(uart_dev, rx_chunk[0], RX_CHUNK, RX_TIMEOUT);
+        if (err)
+        {
+            printk("uart_rx_enable() error. Error code:%d\n\r", err);
+            rx_off = 1;
+            k_msleep(SAMP_PERIOD_MS / 10);
+            k_sem_give(&sem_rcvimg);
+        }
+    }
+}
 
-            if (fin_time < release_time)
-            {
-                k_msleep(release_time - fin_time);
-                release_time += SAMP_PERIOD_MS;
-            }
+void thread_analysis_code(void *argA, void *argB, void *argC)
+{
+    unsigned int img_seq = 0; /* last image analyzed */
+    printk("Thread analysis init\n");
 
-            // print WCET
-            //  printk("WCET_rcvimage: %lld\n", WCET_rcvimage);
+    /* Thread loop */
+    while (1)
+    {
+        unsigned int prev_seq = img_seq;
+        uint8_t *cab_img = (uint8_t *)get_mes_newer(&image_cab, &img_seq, CAB_FOREVER);
+        if (img_seq - prev_seq > 1)
+            printk("analysis skipped %u images\n", img_seq - prev_seq - 1);
+        if (cab_now() - cab_mes_time(&image_cab, cab_img, NULL) > CAB_MS(SAMP_PERIOD_MS))
+        {
+            /* woke up too late, do not spend a job on an old image */
+            printk("analysis dropped a stale image\n");
+            unget((void *)cab_img, &image_cab);
+            continue;
         }
 
-        /*--------------------------*/
-
-        /* Wait for next release instant */
-        fin_time = k_uptime_get();
+        struct frame_result *res = (struct frame_result *)reserve(&result_cab);
+        if (res == NULL)
+        {
+            printk("result_cab full, image dropped\n");
+            unget((void *)cab_img, &image_cab);
+            continue;
+        }
 
-        if (fin_time - t_prev < t_min)
-            t_min = fin_time - t_prev;
-        else if (fin_time - t_prev > t_max)
-            t_max = fin_time - t_prev;
+        /* one pass over the image, read in place, gives the outputs of all
+           three tasks, so they always come from the same image */
+        analyze_frame(IMAGE_VIEW(cab_img), res, &analysis_state);
+        unget((void *)cab_img, &image_cab);
 
-        t_prev = fin_time;
+        put_mes((void *)res, &result_cab); /* wakes the three tasks */
     }
 }
 
@@ -541,6 +871,7 @@ void thread_near_obstacle_code(void *argA, void *argB, void *argC)
 {
     int64_t release_time = 0, start_time = 0, fin_time = 0, t_prev = 0, t_min = SAMP_PERIOD_MS, t_max = SAMP_PERIOD_MS;
 
+    unsigned int res_seq = 0; /* last result processed */
     printk("Thread near_obstacle init\n");
 
     /* Compute next release instant */
@@ -550,43 +881,18 @@ void thread_near_obstacle_code(void *argA, void *argB, void *argC)
     while (1)
     {
         /* Do the workload */
-        k_sem_take(&sem_rcvimg_nearobs, K_FOREVER);
+        unsigned int prev_seq = res_seq;
+        struct frame_result *res = (struct frame_result *)get_mes_newer(&result_cab, &res_seq, CAB_FOREVER);
         start_time = k_uptime_get();
+        if (res_seq - prev_seq > 1)
+            printk("near_obstacle skipped %u images\n", res_seq - prev_seq - 1);
 
         // printk("Detecting nearby obstacles...\n");
 
-        uint8_t *cab_img = (uint8_t *)get_mes(image_cab);
-
-        uint8_t **image = castImage(cab_img);
-        unget((void *)cab_img, image_cab);
-
-        int i, j;
-        uint8_t res = 0;
-
-        for (j = NOB_ROW; j < IMGWIDTH; j++)
-        {
-            int inObs = 0;
-            for (i = NOB_COL; i < NOB_COL + NOB_WIDTH; i++)
-            {
-                if (image[j][i] == OBSTACLE_COLOR)
-                {
-                    inObs++;
-                }
-                else if (inObs > 1)
-                {
-                    inObs = 0;
-                }
-                if (inObs > 1)
-                    res = 1;
-            }
-        }
-
-        // free image
-        for (i = 0; i < IMGWIDTH; i++)
-            free(image[i]);
-        free(image);
+        /* 2 or more adjacent obstacle pixels in the sensor area */
+        nearobs_output = res->near_obstacle;
+        unget((void *)res, &result_cab);
 
-        nearobs_output = res;
         k_sem_give(&sem_tasks_output);
 
         /* Wait for next release instant */
@@ -595,8 +901,6 @@ void thread_near_obstacle_code(void *argA, void *argB, void *argC)
         // if(fin_time - start_time > WCET_nearobs)
         //     WCET_nearobs = fin_time - start_time;
 
-        irq_unlock(key1);
-
         // printk("WCET_nearobs: %lld\n", WCET_nearobs);
 
         // printk("$Near obs -> %lld\n", (long long) k_uptime_get());
@@ -607,7 +911,8 @@ void thread_orientation_code(void *argA, void *argB, void *argC)
 {
     int64_t release_time = 0, start_time = 0, fin_time = 0, t_prev = 0, t_min = SAMP_PERIOD_MS, t_max = SAMP_PERIOD_MS;
     int16_t pos = -1;
-    float angle = -1;
+    int16_t angle = 0; /* Q15 fraction of pi */
+    unsigned int res_seq = 0; /* last result processed */
     printk("Thread orientation init\n");
 
     /* Compute next release instant */
@@ -617,70 +922,37 @@ void thread_orientation_code(void *argA, void *argB, void *argC)
     while (1)
     {
         /* Do the workload */
-        k_sem_take(&sem_rcvimg_orientation, K_FOREVER);
+        unsigned int prev_seq = res_seq;
+        struct frame_result *res = (struct frame_result *)get_mes_newer(&result_cab, &res_seq, CAB_FOREVER);
         start_time = k_uptime_get();
-
-        uint8_t *cab_img = (uint8_t *)get_mes(image_cab);
-
-        uint8_t **image = castImage(cab_img);
-        unget((void *)cab_img, image_cab);
+        if (res_seq - prev_seq > 1)
+            printk("orientation skipped %u images\n", res_seq - prev_seq - 1);
 
         // printk("Detecting position and guideline angle...\n");
-        int i, gf_pos;
+        struct guide_fit fit;
 
-        /* Inits */
+        /* Guideline pos - the measured pixel at the near row, angle - that of
+           a line fitted over the guideline of every GUIDE_STEP-th row, or of
+           the near/far pixels when the line is bent (see guideAngle). Integers
+           only: the execution time does not depend on the image */
         pos = -1;
-        gf_pos = -1;
-
-        /* Search for guideline pos - Near*/
-        for (i = 0; i < IMGWIDTH; i++)
+        angle = 0;
+        if (guideFit(res->guide, GUIDE_STEP, GN_ROW, GF_ROW, &fit) == 0)
         {
-            if (image[GN_ROW][i] == GUIDELINE_COLOR)
-            {
-                pos = i;
-                break;
-            }
-        }
-
-        // /* Search for guideline pos - Far*/
-        for (i = 0; i < IMGWIDTH; i++)
-        {
-            if (image[GF_ROW][i] == GUIDELINE_COLOR)
-            {
-                gf_pos = i;
-                break;
-            }
+            pos = guidePos(&fit);
+            angle = guideAngle(&fit, GN_ROW, GF_ROW);
         }
+        unget((void *)res, &result_cab);
 
-        if (pos == -1 || gf_pos == -1)
+        if (pos == -1)
         {
-            printk("Failed to find guideline pos=%d, gf_pos=%d", pos, gf_pos);
+            printk("Failed to find guideline, %d rows with guideline pixels\n", fit.rows);
             // break;
         }
 
-        /* Approach very grossly the angle (NOT a valid solution - just for testing ) */
-        if (pos == gf_pos)
-        {
-            angle = 0;
-        }
-        else
-        {
-            int pos_delta = gf_pos - *pos;
-            float angle_step = M_PI / 2 / IMGWIDTH;
-            // calculate angle of the guideline
-            *angle = pos_delta * angle_step;
-        }
-
-        // write data on shared memory
-        itoa(pos, orientation_output[0], 10);
-        gcvt(angle, 6, orientation_output[1]);
-
-        // free image
-        for (i = 0; i < IMGWIDTH; i++)
-        {
-            free(image[i]);
-        }
-        free(image);
+        // write data on shared memory, formatted by the output task
+        orientation_pos = pos;
+        orientation_angle = angle;
 
         k_sem_give(&sem_tasks_output);
 
@@ -690,8 +962,6 @@ void thread_orientation_code(void *argA, void *argB, void *argC)
         // if(fin_time - start_time > WCET_orientation)
         //     WCET_orientation = fin_time - start_time;
 
-        irq_unlock(key2);
-
         // printk("WCET_orientation: %lld\n", WCET_orientation);
 
         // printk("$orientation -> %lld\n", (long long) k_uptime_get());
@@ -715,9 +985,35 @@ void thread_output_code(void *argA, void *argB, void *argC)
 
         printk("\tCloseby obstacles detected: %s\n\r", nearobs_output == 1 ? "Yes" : "No");
 
-        printk("\tRobot position=%s, guideline angle=%s\n\r", orientation_output[0], orientation_output[1]);
+        /* angle in tenths of degree, rounded */
+        int deci = (abs(orientation_angle) * 1800 + ANGLE_PI / 2) / ANGLE_PI;
+        printk("\tRobot position=%d, guideline angle=%s%d.%d\n\r", orientation_pos, orientation_angle < 0 ? "-" : "",
+               deci / 10, deci % 10);
 
         printk("\t%d obstacles detected\n\r", obscount_output);
+        if (obscount_dropped != 0)
+            printk("\t%d obstacle runs not labelled, label table full\n\r", obscount_dropped);
+
+#ifdef ANALYSIS_ROW_CACHE
+        printk("\tRow cache: %u of %u rows reused\n\r", row_cache.hits, row_cache.lookups);
+#else
+        printk("\tGuideline tracking: %u rows in window, %u full scans, %u reacquired\n\r", tracker.tracked,
+               tracker.rescans, tracker.reacquired);
+#endif
+
+        printk("\tUART: %u images (%u packed), %u dropped, %u changes without base, %u bad packing, %u overruns, "
+               "%u errors, %u rx events last image\n\r",
+               rx_stats.images, rx_stats.packed, rx_stats.images_dropped, rx_stats.no_ref, rx_stats.bad_packing,
+               rx_stats.overruns, rx_stats.errors, rx_stats.events_last);
+        printk("\tLink at %u baud%s: %u frames, %u CRC errors, %u bad headers, %u skipped, %u bytes out of frames\n\r",
+               uart_cfg.baudrate, uart_cfg.flow_ctrl != UART_CFG_FLOW_CTRL_NONE ? " RTS/CTS" : "", rx_link.frames, rx_link.crc_errors, rx_link.bad_headers, rx_link.skipped, rx_link.hunted);
+
+#ifdef CAB_STATS
+        struct cab_stats stats;
+        cab_stats(&image_cab, &stats, NULL);
+        printk("\timage_cab: %u published, %u read, %u reserve failures, peak %u/%d buffers busy\n\r",
+               stats.publishes, stats.reads, stats.reserve_failures, stats.peak_busy, IMAGE_CAB_NUM);
+#endif
 
         /* Wait for next release instant */
         fin_time = k_uptime_get();
@@ -736,6 +1032,7 @@ void thread_obscount_code(void *argA, void *argB, void *argC)
 {
     int64_t release_time = 0, start_time = 0, fin_time = 0, t_prev = 0, t_min = SAMP_PERIOD_MS, t_max = SAMP_PERIOD_MS;
 
+    unsigned int res_seq = 0; /* last result processed */
     printk("Thread obscount init\n");
 
     /* Compute next release instant */
@@ -745,48 +1042,17 @@ void thread_obscount_code(void *argA, void *argB, void *argC)
     while (1)
     {
         /* Do the workload */
-        k_sem_take(&sem_rcvimg_obscount, K_FOREVER);
+        unsigned int prev_seq = res_seq;
+        struct frame_result *res = (struct frame_result *)get_mes_newer(&result_cab, &res_seq, CAB_FOREVER);
         start_time = k_uptime_get();
-
-        uint8_t *cab_img = (uint8_t *)get_mes(image_cab);
-        uint8_t **image = castImage(cab_img);
-
-        unget((void *)cab_img, image_cab);
+        if (res_seq - prev_seq > 1)
+            printk("obscount skipped %u images\n", res_seq - prev_seq - 1);
 
         // printk("Detecting number of obstacles ...\n");
-        int i, j, nobs;
-
-        /* Inits */
-        nobs = 0;
-
-        /* Search for obstacles. */
-        for (j = 0; j < IMGWIDTH; j++)
-        {
-            int inObs = 0;
-            for (i = 0; i < IMGWIDTH; i++)
-            {
-                if (image[j][i] == OBSTACLE_COLOR)
-                {
-                    inObs++;
-                }
-                else if (inObs > 1)
-                {
-                    nobs++;
-                    inObs = 0;
-                }
-            }
-            if (inObs > 1)
-                nobs++;
-        }
-
-        obscount_output = nobs;
-
-        // free image
-        for (i = 0; i < IMGWIDTH; i++)
-        {
-            free(image[i]);
-        }
-        free(image);
+        /* Obstacles: connected groups of obstacle pixels */
+        obscount_output = res->objects;
+        obscount_dropped = res->dropped;
+        unget((void *)res, &result_cab);
 
         k_sem_give(&sem_tasks_output);
 
@@ -798,8 +1064,6 @@ void thread_obscount_code(void *argA, void *argB, void *argC)
 
         t_prev = fin_time;
 
-        irq_unlock(key3);
-
         // printk("$obs count -> %lld\n\n", (long long) k_uptime_get());
         // printk("WCET_obscount: %lld\n", WCET_obscount);
     }
@@ -811,44 +1075,33 @@ void thread_obscount_code(void *argA, void *argB, void *argC)
 /* Should be kept as short and simple as possible. Heavier processing should be deferred to a task with suitable priority*/
 static void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 {
-    int err;
-
     switch (evt->type)
     {
 
     case UART_TX_DONE:
         // printk("UART_TX_DONE event \n\r");
+        k_sem_give(&sem_tx); /* link control message out */
         break;
 
     case UART_TX_ABORTED:
         // printk("UART_TX_ABORTED event \n\r");
+        k_sem_give(&sem_tx);
         break;
 
     case UART_RX_RDY:
         // printk("UART_RX_RDY event \n\r");
-        /* Just copy data to a buffer. Usually it is preferable to use e.g. a FIFO to communicate with a task that shall process the messages*/
-        // printk("Received %d bytes. nchar= %d, %d\n", evt->data.rx.len, uart_rxbuf_nchar, evt->data.rx.offset);
-        if (uart_rxbuf_nchar + evt->data.rx.len > RXBUF_SIZE)
-        {
-            printk("Error. Received more data than expected for %d x %d \n", IMGWIDTH, IMGWIDTH);
-            uart_rxbuf_nchar = 0;
-            break;
-        }
-        memcpy(&rx_chars[uart_rxbuf_nchar], &(rx_buf[evt->data.rx.offset]), evt->data.rx.len);
-        uart_rxbuf_nchar += evt->data.rx.len;
-
-        if (uart_rxbuf_nchar == RXBUF_SIZE)
-        {
-            uart_rxbuf_nchar = 0;
-            k_sem_give(&sem_rcvimg);
-            key1 = irq_lock();
-            key2 = irq_lock();
-            key3 = irq_lock();
-        }
+        /* New bytes in the current chunk: the parser copies the payload
+           into its buffer, the frame is queued for the receive task at its end */
+        rx_stats.events++;
+        linkParse(&rx_link, evt->data.rx.buf + evt->data.rx.offset, evt->data.rx.len);
         break;
 
     case UART_RX_BUF_REQUEST:
         // printk("UART_RX_BUF_REQUEST event \n\r");
+        /* Always answered with the other chunk, so reception never stops.
+           It was released before this request, its bytes already parsed */
+        uart_rx_buf_rsp(dev, rx_chunk[rx_next], RX_CHUNK);
+        rx_next ^= 1;
         break;
 
     case UART_RX_BUF_RELEASED:
@@ -856,19 +1109,20 @@ static void uart_cb(const struct device *dev, struct uart_event *evt, void *user
         break;
 
     case UART_RX_DISABLED:
-        /* When the RX_BUFF becomes full RX is is disabled automaticaly.  */
+        /* Chained buffers keep RX on, it is only disabled after errors
+           or for a new link rate. */
         /* It must be re-enabled manually for continuous reception */
         // printk("UART_RX_DISABLED event \n\r");
-        err = uart_rx_enable(uart_dev, rx_buf, sizeof(rx_buf), RX_TIMEOUT);
-        if (err)
-        {
-            printk("uart_rx_enable() error. Error code:%d\n\r", err);
-            exit(FATAL_ERR);
-        }
+        rx_off = 1;
+        k_sem_give(&sem_rcvimg);
         break;
 
     case UART_RX_STOPPED:
         // printk("UART_RX_STOPPED event \n\r");
+        if (evt->data.rx_stop.reason == UART_ERROR_OVERRUN)
+            rx_stats.overruns++;
+        else
+            rx_stats.errors++;
         break;
 
     default:
@@ -876,21 +1130,3 @@ static void uart_cb(const struct device *dev, struct uart_event *evt, void *user
         break;
     }
 }
-
-uint8_t **castImage(uint8_t *img)
-{
-    uint8_t **image = (uint8_t **)malloc(IMGWIDTH * sizeof(uint8_t *));
-    for (int i = 0; i < IMGWIDTH; i++)
-    {
-        image[i] = (uint8_t *)malloc(IMGWIDTH * sizeof(uint8_t));
-    }
-
-    for (int i = 0; i < IMGWIDTH; i++)
-    {
-        for (int j = 0; j < IMGWIDTH; j++)
-        {
-            image[i][j] = img[i * IMGWIDTH + j];
-        }
-    }
-    return image;
-}
@@ -2,7 +2,11 @@
  * SOTR 22-23
  * Paulo Pedreiras, Nov. 2022
  * nRF boards register as /dev/ttyACMx (usually ACM0)
- * Default config is 115200,8,n,1
+ * Default config is 115200,8,n,1, faster rates and RTS/CTS are
+ * negotiated with the target (see imgLink.h):
+ *   serialTest [-d device] [-r max baud] [-f] [-b] [-n frames]
+ *   -f  RTS/CTS flow control
+ *   -b  benchmark: bytes/s and frame loss at each rate up to -r
  * Can try it with any nRF example that outputs text to the terminal
  * and/or with the console example
  *
@@ -32,15 +36,297 @@
 #include <errno.h>   // Error integer and strerror() function
 #include <termios.h> // Contains POSIX terminal control definitions
 #include <unistd.h>  // write(), read(), close()
+#include <time.h>    // clock_nanosleep()
+#include <poll.h>    // poll(), waiting for the target with a timeout
+#include <getopt.h>
+
+#include "imgLink.h"
 
 #define IMGWIDTH 128 /* Square image. Side size, in pixels*/
+#define NIMAGES 99
+#define FRAME_PERIOD_MS 100 /* 10 images per second */
+#define KEY_INTERVAL 10     /* every 10th image is sent whole, not as a change */
 
 void readRawImage(char *filename, uint8_t *image);
 
-int main()
+int serial_port;
+uint32_t linkBaud = LINK_BASE_BAUD; // current rate and flow control
+int linkFlow = 0;
+
+// Control messages from the target, parsed out of its console output
+struct link_parser hostLink;
+uint8_t ctrlBuffer[LINK_CTRL_SIZE];
+struct link_ctrl ctrlMessage;
+int ctrlReceived;
+int fallbackReceived;
+
+uint8_t *ctrlFrameBuffer(void *ctx, const struct link_hdr *h)
+{
+  return h->flags == LINK_CTRL && h->len == LINK_CTRL_SIZE ? ctrlBuffer : NULL;
+}
+
+void ctrlFrameDone(void *ctx, uint8_t *buf, const struct link_hdr *h, int ok)
+{
+  if (!ok || linkCtrlRead(&ctrlMessage, h, buf) != 0)
+    return;
+  ctrlReceived = 1;
+  if (ctrlMessage.type == LINK_FALLBACK)
+    fallbackReceived = 1;
+}
+
+speed_t baudConstant(uint32_t baud)
+{
+  switch (baud)
+  {
+  case 115200:
+    return B115200;
+  case 230400:
+    return B230400;
+  case 460800:
+    return B460800;
+  case 921600:
+    return B921600;
+  case 1000000:
+    return B1000000;
+  case 2000000:
+    return B2000000;
+  }
+  return B0;
+}
+
+// Changes the rate and flow control of the port, after what was written is out
+int setLink(uint32_t baud, int flow)
+{
+  struct termios tty;
+  if (tcgetattr(serial_port, &tty) != 0)
+    return -1;
+  if (flow)
+    tty.c_cflag |= CRTSCTS;
+  else
+    tty.c_cflag &= ~CRTSCTS;
+  cfsetispeed(&tty, baudConstant(baud));
+  cfsetospeed(&tty, baudConstant(baud));
+  if (tcsetattr(serial_port, TCSADRAIN, &tty) != 0)
+  {
+    printf("Error %i from tcsetattr: %s\n", errno, strerror(errno));
+    return -1;
+  }
+  linkBaud = baud;
+  linkFlow = flow;
+  return 0;
+}
+
+void sendCtrl(uint8_t type, uint32_t baud, int flow)
+{
+  uint8_t frame[LINK_CTRL_SIZE + LINK_OVERHEAD];
+  struct link_ctrl c = {.type = type, .flow = flow ? LINK_FLOW_RTS_CTS : 0, .baud = baud};
+  size_t n = linkCtrlFrame(frame, &c);
+  if (write(serial_port, frame, n) != (ssize_t)n)
+    printf("Error sending control message: %s\n", strerror(errno));
+}
+
+// Reads what the target sent for up to timeout_ms, until a control message
+// of the given type. Returns 0 when it came, -1 otherwise
+int waitCtrl(uint8_t type, int timeout_ms, struct link_ctrl *msg)
+{
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (1)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int left = timeout_ms - (int)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+    struct pollfd pfd = {.fd = serial_port, .events = POLLIN};
+    if (poll(&pfd, 1, left > 0 ? left : 0) <= 0)
+      return -1;
+    uint8_t data[256];
+    ssize_t n = read(serial_port, data, sizeof(data));
+    if (n <= 0)
+      return -1;
+    for (ssize_t i = 0; i < n; i++)
+    {
+      // one byte at a time, so a message is seen before the next one overwrites it
+      linkParse(&hostLink, data + i, 1);
+      if (ctrlReceived)
+      {
+        ctrlReceived = 0;
+        if (ctrlMessage.type == type)
+        {
+          *msg = ctrlMessage;
+          return 0;
+        }
+      }
+    }
+  }
+}
+
+// The target did not answer at the current rate: back to the base rate,
+// where the target also goes once it got no valid frame for LINK_IDLE_MS
+void linkLost(void)
+{
+  printf("No answer at %u baud, back to %u\n", linkBaud, LINK_BASE_BAUD);
+  setLink(LINK_BASE_BAUD, 0);
+  usleep(LINK_IDLE_MS * 1000); // sending nothing meanwhile
+  tcflush(serial_port, TCIFLUSH);
+}
+
+// Switches both ends to a new rate, see LINK_SET_RATE. Returns 0, or -1 with
+// both ends back at the current rate
+int negotiate(uint32_t baud, int flow)
+{
+  uint32_t prevBaud = linkBaud;
+  int prevFlow = linkFlow;
+  struct link_ctrl reply;
+
+  sendCtrl(LINK_SET_RATE, baud, flow);
+  if (waitCtrl(LINK_RATE_OK, LINK_CONFIRM_MS, &reply) != 0 || reply.baud != baud)
+  {
+    printf("Target refused %u baud\n", baud);
+    return -1;
+  }
+  if (setLink(baud, flow) != 0)
+    return -1;
+  usleep(20000); // the target reconfigures its UART
+  tcflush(serial_port, TCIFLUSH);
+  sendCtrl(LINK_CONFIRM, baud, flow);
+  if (waitCtrl(LINK_CONFIRM, LINK_CONFIRM_MS, &reply) != 0)
+  {
+    printf("No confirmation at %u baud%s, back to %u\n", baud, flow ? " with RTS/CTS" : "", prevBaud);
+    setLink(prevBaud, prevFlow);
+    usleep(2 * LINK_CONFIRM_MS * 1000); // until the target gave it up too
+    return -1;
+  }
+  printf("Link at %u baud%s\n", baud, flow ? " with RTS/CTS" : "");
+  return 0;
+}
+
+// Steps the rate up, one rate after the other, to at most maxBaud
+void stepUp(uint32_t maxBaud, int flow)
+{
+  for (int i = 0; i < LINK_NRATES && linkRates[i] <= maxBaud; i++)
+    if ((linkRates[i] > linkBaud || (linkRates[i] == linkBaud && flow != linkFlow)) &&
+        negotiate(linkRates[i], flow) != 0)
+      break;
+}
+
+// Sends an image in a frame (see imgLink.h), so the receiver can find where
+// it starts and check it arrived intact. Packed, or as the change from the
+// previous image when that is smaller, raw if neither fits. Returns the
+// bytes written, -1 on error
+ssize_t sendImage(const uint8_t *image, const uint8_t *prev, uint16_t seq, const char **kind)
 {
+  static uint8_t packed[2][LINK_PACKED_MAX], frame[IMGWIDTH * IMGWIDTH + LINK_OVERHEAD];
+  struct link_hdr hdr = {.width = IMGWIDTH, .height = IMGWIDTH, .seq = seq, .flags = LINK_RAW,
+                         .len = IMGWIDTH * IMGWIDTH};
+  const uint8_t *payload = image;
+  size_t rle = linkPack(packed[0], LINK_PACKED_MAX, image, NULL, IMGWIDTH, IMGWIDTH);
+  size_t delta = 0;
+  if (prev != NULL && seq % KEY_INTERVAL != 0)
+    delta = linkPack(packed[1], LINK_PACKED_MAX, image, prev, IMGWIDTH, IMGWIDTH);
+  *kind = "raw";
+  if (delta != 0 && (rle == 0 || delta < rle))
+  {
+    hdr.flags = LINK_DELTA;
+    hdr.len = delta;
+    payload = packed[1];
+    *kind = "change";
+  }
+  else if (rle != 0)
+  {
+    hdr.flags = LINK_RLE;
+    hdr.len = rle;
+    payload = packed[0];
+    *kind = "packed";
+  }
+  size_t frame_size = linkFrame(frame, &hdr, payload);
+  return write(serial_port, frame, frame_size);
+}
+
+double seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Sends nframes images back to back at each rate up to maxBaud, and asks
+// the target how many arrived
+void benchmark(uint8_t images[][IMGWIDTH * IMGWIDTH], int nimages, uint32_t maxBaud, int flow, int nframes)
+{
+  uint16_t seq = 1;
+  // loss: frames that did not make it over the link, skipped: frames that
+  // did but found no free buffer on the target
+  printf("%8s %10s %12s %8s %8s %6s %8s\n", "baud", "flow", "bytes/s", "frames", "CRC err", "loss", "skipped");
+  for (int r = 0; r < LINK_NRATES && linkRates[r] <= maxBaud; r++)
+  {
+    // negotiated even at the current rate, it restarts the target's counters
+    if (negotiate(linkRates[r], flow) != 0)
+    {
+      printf("%8u %10s not reached\n", linkRates[r], flow ? "RTS/CTS" : "none");
+      continue;
+    }
+    struct link_ctrl report;
+    waitCtrl(0, 50, &report); // console output before the run
+    long bytes = 0;
+    const char *kind;
+    double t0 = seconds();
+    for (int f = 0; f < nframes; f++, seq++)
+    {
+      ssize_t n = sendImage(images[f % nimages], f > 0 ? images[(f - 1) % nimages] : NULL, seq, &kind);
+      if (n > 0)
+        bytes += n;
+    }
+    tcdrain(serial_port);
+    double t = seconds() - t0;
+    sendCtrl(LINK_REPORT, linkBaud, linkFlow);
+    if (waitCtrl(LINK_REPORT, 1000, &report) != 0)
+    {
+      printf("%8u %10s %12.0f no report\n", linkBaud, flow ? "RTS/CTS" : "none", bytes / t);
+      linkLost();
+      continue;
+    }
+    printf("%8u %10s %12.0f %4u/%-3d %8u %5.1f%% %8u\n", linkBaud, flow ? "RTS/CTS" : "none", bytes / t, report.frames,
+           nframes, report.crc_errors, 100.0 * (nframes - (int)report.frames) / nframes, report.skipped);
+    seq += KEY_INTERVAL - seq % KEY_INTERVAL; // next run starts with a whole image
+  }
+  if (linkBaud != LINK_BASE_BAUD || linkFlow)
+    negotiate(LINK_BASE_BAUD, 0);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *device = "/dev/ttyACM0";
+  uint32_t maxBaud = LINK_BASE_BAUD;
+  int flow = 0, bench = 0, nframes = 100, opt;
+  while ((opt = getopt(argc, argv, "d:r:fbn:")) != -1)
+    switch (opt)
+    {
+    case 'd':
+      device = optarg;
+      break;
+    case 'r':
+      maxBaud = strtoul(optarg, NULL, 10);
+      break;
+    case 'f':
+      flow = 1;
+      break;
+    case 'b':
+      bench = 1;
+      break;
+    case 'n':
+      nframes = atoi(optarg);
+      break;
+    default:
+      printf("usage: %s [-d device] [-r max baud] [-f] [-b] [-n frames]\n", argv[0]);
+      return 1;
+    }
+  if (baudConstant(maxBaud) == B0 || nframes <= 0)
+  {
+    printf("Unsupported rate %u\n", maxBaud);
+    return 1;
+  }
+
   // Open the serial port. Change device path as needed (currently set to an standard FTDI USB-UART cable type device)
-  int serial_port = open("/dev/ttyACM0", O_RDWR);
+  serial_port = open(device, O_RDWR);
   
 
   // Create new termios struct, we call it 'tty' for convention
@@ -77,7 +363,7 @@ int main()
   tty.c_cc[VTIME] = 10; // Wait for up to 1s (10 deciseconds), returning as soon as any data is received.
   tty.c_cc[VMIN] = 1;
 
-  // Set in/out baud rate to be 115200
+  // Set in/out baud rate to the base one, 115200
   cfsetispeed(&tty, B115200);
   cfsetospeed(&tty, B115200);
 
@@ -89,19 +375,34 @@ int main()
   }
   
 
-  for (int image_index = 1; image_index < 100; image_index++)
+  linkInit(&hostLink, LINK_CTRL_SIZE, ctrlFrameBuffer, ctrlFrameDone, NULL);
+
+  static uint8_t images[NIMAGES][IMGWIDTH * IMGWIDTH];
+  for (int i = 0; i < NIMAGES; i++)
+  {
+    char filename[32];
+    sprintf(filename, "images/img%d.raw", i + 1);
+    readRawImage(filename, images[i]);
+  }
+
+  if (bench)
   {
-    uint8_t *imageBuffer = calloc(IMGWIDTH * IMGWIDTH, sizeof(char));
-    char *filename = calloc(20, sizeof(char));
-    sprintf(filename, "images/img%d.raw", image_index);
-    
-    readRawImage(filename, imageBuffer);
-    
-    
-    // Read bytes. The behaviour of read() (e.g. does it block?,
-    // how long does it block for?) depends on the configuration
-    // settings above, specifically VMIN and VTIME
-    ssize_t bytes_written = write(serial_port, imageBuffer, sizeof(uint8_t) * IMGWIDTH * IMGWIDTH);
+    benchmark(images, NIMAGES, maxBaud, flow, nframes);
+    close(serial_port);
+    return 0;
+  }
+
+  stepUp(maxBaud, flow);
+
+  struct timespec release;
+  clock_gettime(CLOCK_MONOTONIC, &release);
+  double aliveCheck = seconds() + LINK_ALIVE_MS / 1000.0;
+
+  for (int image_index = 1; image_index <= NIMAGES; image_index++)
+  {
+    const char *kind;
+    ssize_t bytes_written = sendImage(images[image_index - 1], image_index > 1 ? images[image_index - 2] : NULL,
+                                      image_index, &kind);
 
     // n is the number of bytes read. n may be 0 if no bytes were received, and can also be -1 to signal an error.
     if (bytes_written < 0)
@@ -110,19 +411,51 @@ int main()
       exit(1);
     }
     else
-      printf("Sent %i bytes", bytes_written);
+      printf("Sent %i bytes (%s)\n", bytes_written, kind);
 
     fflush(stdout);
-    //wait 5s
-    sleep(5);
+    // wait until the frame is on the wire, then for the next period (a raw
+    // frame takes longer than a period, the next ones then catch up)
+    tcdrain(serial_port);
+    release.tv_nsec += FRAME_PERIOD_MS * 1000000L;
+    if (release.tv_nsec >= 1000000000L)
+    {
+      release.tv_sec++;
+      release.tv_nsec -= 1000000000L;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &release, NULL);
 
-    //free memory
-    free(imageBuffer);
-    free(filename);
+    // the target falls back to the base rate on CRC errors: follow it and
+    // step up again, below the rate that failed. Away from the base rate it
+    // must also answer a LINK_REPORT now and then, in case it fell back
+    // and its LINK_FALLBACK was lost, or it lost the rate
+    struct link_ctrl msg;
+    waitCtrl(LINK_FALLBACK, 0, &msg);
+    int lost = 0;
+    if (!fallbackReceived && (linkBaud != LINK_BASE_BAUD || linkFlow) && seconds() >= aliveCheck)
+    {
+      sendCtrl(LINK_REPORT, linkBaud, linkFlow);
+      lost = waitCtrl(LINK_REPORT, LINK_CONFIRM_MS, &msg) != 0 && !fallbackReceived;
+      aliveCheck = seconds() + LINK_ALIVE_MS / 1000.0;
+    }
+    if (fallbackReceived || lost)
+    {
+      uint32_t failed = linkBaud;
+      fallbackReceived = 0;
+      if (lost)
+        linkLost();
+      else
+      {
+        printf("Target fell back from %u baud\n", failed);
+        setLink(LINK_BASE_BAUD, 0);
+      }
+      for (int i = 0; i < LINK_NRATES && linkRates[i] < failed; i++)
+        maxBaud = linkRates[i];
+      stepUp(maxBaud, flow);
+      clock_gettime(CLOCK_MONOTONIC, &release);
+    }
   }
 
-
-
   close(serial_port);
   return 0; // success
 };